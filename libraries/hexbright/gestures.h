@@ -0,0 +1,69 @@
+/*
+Copyright (c) 2012, "David Hilton" <dhiltonp@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies, 
+either expressed or implied, of the FreeBSD Project.
+*/
+
+// Starter gesture templates for hexbright::match_gesture.
+// Include this from one sketch only; each template costs 48 bytes of flash.
+//
+// Like the matcher, these end just after the motion stops, with the 
+//  gravity at that moment taken out (so a twist starts offset and ends at 0).
+// These were drawn by hand to be roughly the right shape, and assume a tick 
+//  of about 18 ms.  You'll get much better matching from templates built 
+//  from your own recordings (see programs/gestures and tools/gesture_template.py).
+
+#ifndef GESTURES_H
+#define GESTURES_H
+
+#include <hexbright.h>
+
+#define GESTURE_FLICK      0 // quick flick of the wrist, sideways
+#define GESTURE_TWIST      1 // roll the light a quarter turn around its axis
+#define GESTURE_DOUBLE_TAP 2 // tap the tail on a table twice
+
+const gesture gesture_templates[] PROGMEM = {
+  { // GESTURE_FLICK
+    {  0, 0, 0}, {  2, 0, 0}, {  6, 1, 0}, { 12, 2, 1},
+    { 20, 3, 1}, { 24, 2, 0}, { 16, 1,-1}, {  4, 0,-1},
+    { -8,-1, 0}, {-16,-2, 0}, {-18,-2, 1}, {-12,-1, 0},
+    { -5, 0, 0}, { -1, 0, 0}, {  0, 0, 0}, {  0, 0, 0}
+  },
+  { // GESTURE_TWIST
+    { 20, 0, 9}, { 20, 0, 9}, { 19, 0, 9}, { 17, 0, 8},
+    { 14, 0, 6}, { 10, 0, 4}, {  6, 0, 3}, {  3, 0, 1},
+    {  1, 0, 0}, {  0, 0, 0}, {  0, 0, 0}, {  0, 0, 0},
+    {  0, 0, 0}, {  0, 0, 0}, {  0, 0, 0}, {  0, 0, 0}
+  },
+  { // GESTURE_DOUBLE_TAP
+    {  0,  0, 0}, {  0,  0, 0}, {  1,-24, 1}, { -1,  8, 0},
+    {  0, -2, 0}, {  0,  0, 0}, {  0,  0, 0}, {  0,  0, 0},
+    {  0,  0, 0}, {  1,-24, 1}, { -1,  8, 0}, {  0, -2, 0},
+    {  0,  0, 0}, {  0,  0, 0}, {  0,  0, 0}, {  0,  0, 0}
+  }
+};
+
+#endif
@@ -29,6 +29,13 @@ either expressed or implied, of the FreeBSD Project.
 
 
 #include "hexbright.h"
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
+
+#ifdef __AVR__
+// the core's count behind millis (wiring.c), see adc_sleep
+extern volatile unsigned long timer0_millis;
+#endif
 
 // Pin assignments
 #define DPIN_RLED_SW 2 // both red led and switch.  pinMode OUTPUT = led, pinMode INPUT = switch
@@ -36,22 +43,282 @@ either expressed or implied, of the FreeBSD Project.
 #define DPIN_PWR 8
 #define DPIN_DRV_MODE 9
 #define DPIN_DRV_EN 10
+#define DRV_MODE_BIT _BV(PORTB1) // DPIN_DRV_MODE, for writing from an interrupt
 #define APIN_TEMP 0
 #define APIN_CHARGE 3
+#define DPIN_SDA 18 // analog pin 4
+#define DPIN_SCL 19 // analog pin 5
 
 
 ///////////////////////////////////////////////
-/////////////HARDWARE INIT, UPDATE/////////////
+/////////////////////STATE/////////////////////
 ///////////////////////////////////////////////
 
-int ms_delay;
-unsigned long last_time;
+// Everything the library remembers from one call to the next, gathered up
+//  so a host simulator (tools/replay) can keep one per virtual light.  On 
+//  the light there's just the one, and ctx.ms_delay is the same direct 
+//  access a plain global would be.  Number printing and the accelerometer 
+//  get their own objects there (number_ctx, acc_ctx), so a hexbright_fixed 
+//  sketch without them doesn't pay for their RAM: the linker drops an 
+//  object nothing left refers to.  (The twi buffers stay in hexbright_state, 
+//  its interrupt is linked in regardless.)
+
+#define ADC_CONVERSIONS (THERMAL_SAMPLES+3) // see ADC
+#define ADC_NO_ROUND (ADC_CONVERSIONS+1) // no round started yet, see read_adc
+// 13 adc clocks; the core runs the adc at F_CPU/128
+#define ADC_CONVERSION_US (13*128/(F_CPU/1000000))
+#define ACC_NO_READ 0xFF // see start_accelerometer_read
+#define ACC_RATE_AUTO 0xFF // see set_accelerometer_rate
+
+#if (DEBUG!=DEBUG_OFF)
+struct debug_event {
+  byte id;
+  byte tick; // update count, mod 256
+  int value;
+};
+#endif
+
+#if (defined(LED) && defined(PRINT_NUMBER))
+// number printing (see init_number_state)
+struct number_state {
+  long _number;
+  byte _color;
+  int print_wait_time;
+  // number printing times, in updates; worked out once rather than dividing
+  //  by ms_delay for every flash
+  int number_gap_ticks;   // 2500 ms between numbers
+  int flash_gap_ticks;    // 300 ms between flashes
+  int digit_gap_ticks;    // 600 ms between digits
+  int zero_flash_ticks;   // 400 ms
+  int flash_ticks;        // 120 ms
+  int negative_flash_ticks; // 500 ms
+  int led_wait_ticks;     // set_led's default wait_time
+};
+#endif
+
+#ifdef ACCELEROMETER
+// see init_accelerometer_state
+struct accelerometer_state {
+  // accelerometer
+  boolean using_accelerometer;
+  double vectors[6];
+  double* new_vector;
+  double* old_vector;
+  double down[3];
+  // low-pass filtered acceleration, in raw readings << GRAVITY_FRACTION_BITS
+  int gravity[3];
+  boolean gravity_set;
+
+  double old_magnitude;
+  double new_magnitude;
+  double dp;
+  double angle_change;
+  double axes_rotation[3];
+
+  double light_axis[3];
+
+  // raw sample history (ring buffer), with running sums for the windowed statistics
+  char acc_raw[3];
+  char acc_history[ACC_HISTORY][3];
+  byte acc_history_pos; // next slot to be overwritten (the oldest sample)
+  int acc_sum[3];
+  unsigned int acc_sum_squares[3];
+  char acc_min[3];
+  char acc_max[3];
+
+  // set by the accelerometer's interrupt line, cleared once TILT has been read
+  volatile boolean acc_interrupt;
+  // first register of the read in flight, see start_accelerometer_read
+  byte acc_read_start;
+  // ACC_USE_* flags; what the sketch wants, and what the accelerometer is set up for
+  byte acc_use;
+  byte acc_mode;
+
+  // sample rate, and the filtering tuned for it (see set_accelerometer_rate)
+  byte acc_rate;
+  byte acc_filter;
+  byte gravity_filter_shift;
+  byte acc_debounce;
+  int acc_wait_ms; // until the next sample
+  byte acc_events;
+  byte acc_tilt; // orientation bits of the last TILT reading
+};
+#endif
+
+struct hexbright_state {
+  int ms_delay;
+  unsigned long last_time;
+  // shutdown() was called, and nothing (set_light or the button) has woken us since
+  boolean shut_down;
+  // the driver is running (set_light_level with a level above 0)
+  boolean light_on;
+
+#if (DEBUG!=DEBUG_OFF)
+  int loop_report_wait; // updates until the next EVENT_LOOP_TIME
+  float avg_loop_time;
+  debug_event event_ring[DEBUG_EVENT_SLOTS];
+  // head==tail is empty, so one slot is always left unused
+  byte event_head;
+  byte event_tail;
+  byte events_dropped; // since the last EVENT_DROPPED (stops at 255)
+  byte event_tick;
+  int logged_temperature;
+  long last_logged;
+  int logged_mv;
+#endif
+
+  // light control
+  int start_light_level;
+  int end_light_level;
+  int change_duration;
+  int change_done;
+  int safe_light_level;
+  int battery_light_level;
+  int battery_mv; // this update's get_battery_mv
+  // get_thermal_sensor() reading where overheat protection starts dimming,
+  //  worked out from OVERHEAT_CELSIUS and the thermal calibration
+  int overheat_temperature;
+  volatile byte driver_mode; // DPIN_DRV_MODE, once TIMER1_COMPA applies it
+  byte driver_pwm;     // DPIN_DRV_EN
+
+#ifdef LED
+  // >0 = countdown, 0 = change state, -1 = state changed
+  int led_wait_time[2];
+  int led_on_time[2];
+  byte led_brightness[2];
+#endif
+
+  // button
+  int time_held;
+  boolean released;
+
+#ifdef ACCELEROMETER
+  // twi
+  volatile byte twi_state;
+  byte twi_address;
+  byte twi_write_count;
+  byte twi_read_count;
+  volatile byte twi_index;
+  // written out first, then overwritten with anything read
+  volatile byte twi_buffer[8]; // enable_accelerometer writes 7
+#endif
+
+  // adc
+  volatile int adc_values[ADC_CONVERSIONS];
+  // conversion in progress, ADC_CONVERSIONS when the round is finished
+  //  (ADC_NO_ROUND before the first one)
+  volatile byte adc_index;
+  volatile byte adc_start_tcnt; // TCNT0 when the running conversion started
+  unsigned int adc_slept_us; // not yet added to millis, see adc_sleep
+  int thermal_sensor_value;
+  unsigned int thermal_sum; // samples waiting to be decimated
+  byte thermal_count;
+  unsigned int thermal_filter; // fine reading << THERMAL_FILTER_SHIFT
+  int charge_value;
+  unsigned int vcc_filter; // bandgap reading << VCC_FILTER_SHIFT
+
+  // Thermal calibration, in fine readings (get_thermal_sensor_fine).  
+  //  Conversions are (fine-thermal_zero)*scale>>16, with the scales worked 
+  //  out once rather than dividing (or pulling in float) every time.
+  int thermal_zero;
+  long celsius_scale; // celsius per fine reading, 16.16 fixed point
+  long fahrenheit_scale; // fahrenheit per fine reading, 16.16 fixed point
+
+  // charging
+  byte charge_reading; // this update's state, with hysteresis
+  byte charge_stable; // debounced state, 0 until the first reading
+  int charge_pending_ms; // how long charge_reading has differed from charge_stable
+  byte charge_events;
+
+#ifdef TELEMETRY
+  byte telemetry_buffer[TELEMETRY_BUFFER];
+  // head==tail is empty, so one byte is always left unused
+  volatile byte telemetry_head; // written by send_telemetry
+  volatile byte telemetry_tail; // written by the interrupt
+  byte telemetry_dropped; // since the last record sent (stops at 255)
+  unsigned int telemetry_tick;
+#endif
+
+#ifndef __AVR__
+#if (defined(LED) && defined(PRINT_NUMBER))
+  number_state number;
+#endif
+#ifdef ACCELEROMETER
+  accelerometer_state acc;
+#endif
+#endif
+};
+
+#ifdef __AVR__
+static hexbright_state ctx;
+#if (defined(LED) && defined(PRINT_NUMBER))
+static number_state number_ctx;
+#endif
+#ifdef ACCELEROMETER
+static accelerometer_state acc_ctx;
+#endif
+#else
+// each thread runs the light it last selected
+static hexbright_state default_state;
+static __thread hexbright_state* current_state = &default_state;
+#define ctx (*current_state)
+#define number_ctx (ctx.number)
+#define acc_ctx (ctx.acc)
+
+hexbright_state* hexbright_new_state() {
+  return new hexbright_state(); // zeroed, the constructor does the rest
+}
+
+void hexbright_delete_state(hexbright_state* state) {
+  if(current_state == state)
+    current_state = &default_state;
+  delete state;
+}
+
+void hexbright_select_state(hexbright_state* state) {
+  current_state = state ? state : &default_state;
+}
+#endif
+
+///////////////////////////////////////////////
+/////////////HARDWARE INIT, UPDATE/////////////
+///////////////////////////////////////////////
 
 hexbright::hexbright(int update_delay_ms) {
-  ms_delay = update_delay_ms;
+  init_state(update_delay_ms);
+#if (defined(LED) && defined(PRINT_NUMBER))
+  init_number_state();
+#endif
+#ifdef ACCELEROMETER
+  init_accelerometer_state();
+#endif
+}
+
+// the state starts out zeroed, these are the exceptions
+void hexbright::init_state(int update_delay_ms) {
+  ctx.ms_delay = update_delay_ms;
+  ctx.safe_light_level = MAX_LEVEL;
+  ctx.battery_light_level = MAX_LEVEL;
+  ctx.overheat_temperature = 320;
+  ctx.released = true;
+#if (DEBUG!=DEBUG_OFF)
+  ctx.logged_temperature = -1;
+#endif
+#ifdef LED
+  for(byte i=0; i<2; i++)
+    ctx.led_wait_time[i] = ctx.led_on_time[i] = -1;
+#endif
+  ctx.adc_index = ADC_NO_ROUND;
 }
 
 void hexbright::init_hardware() {
+  init_common();
+#ifdef ACCELEROMETER
+  enable_accelerometer();
+#endif
+}
+
+void hexbright::init_common() {
   // We just powered on! That means either we got plugged
   // into USB, or the user is pressing the power button.
   pinMode(DPIN_PWR, INPUT);
@@ -63,12 +330,13 @@ void hexbright::init_hardware() {
   pinMode(DPIN_DRV_EN, OUTPUT);
   digitalWrite(DPIN_DRV_MODE, LOW);
   digitalWrite(DPIN_DRV_EN, LOW);
+  // OCR1A matches at the top of the pwm period, see set_light_level
+  OCR1A = 255;
 
 #if (DEBUG!=DEBUG_OFF)
   // Initialize serial busses
-  Serial.begin(9600);
-  Wire.begin();
-  Serial.println("DEBUG MODE ON");
+  Serial.begin(DEBUG_BAUD);
+  Serial.println(F("DEBUG MODE ON"));
   if(DEBUG==DEBUG_LIGHT) {
     // do a full light range sweep, (printing all light intensity info)
     set_light(0,1000,1000);
@@ -76,88 +344,155 @@ void hexbright::init_hardware() {
     set_light(0, MAX_LEVEL, NOW);
   } else if (DEBUG==DEBUG_LOOP) {
     // note the use of TIME_MS/ms_delay.
-    set_light(0, MAX_LEVEL, 2500/ms_delay);
+    set_light(0, MAX_LEVEL, 2500/ctx.ms_delay);
   }
 #endif
-
-#ifdef ACCELEROMETER
-  if(ms_delay<9) {
-#if (DEBUG!=DEBUG_OFF)
-    Serial.println("Warning, ms_delay too low for accelerometer.  Adjusting to 9 ms.");
-#endif
-    ms_delay = 9;
-  }
-  enable_accelerometer();
+#ifdef TELEMETRY
+  init_telemetry();
 #endif
+
+  load_thermal_calibration();
+
+  // wait for two rounds of readings, so the getters have something to return
+  read_adc();
+  while(!read_adc());
+  while(!read_adc());
   
-  last_time = millis();
+  ctx.last_time = millis();
 }
 
 
+// update() is split into stages so hexbright_fixed can leave some out.
 void hexbright::update() {
+  wait_for_update();
+#ifdef LED
+  update_leds();
+#ifdef PRINT_NUMBER
+  update_number();
+#endif
+#else
+  read_button();
+#endif
+  read_adc(); // results from the last update, and start the next round in the background
+#ifdef ACCELEROMETER
+  collect_accelerometer(); // the read started at the end of the last update
+#endif
+  update_light();
+#ifdef ACCELEROMETER
+  update_accelerometer_mode();
+  // runs in the background until the next update
+  start_accelerometer_read();
+#endif
+}
+
+void hexbright::wait_for_update() {
   unsigned long time;
   do {
     time = millis();
-  } while (time-last_time < ms_delay);
+#if (DEBUG==DEBUG_OFF) && !defined(TELEMETRY)
+    // (telemetry's usart never stops, and sleeping would stretch its bits)
+    adc_sleep();
+#endif
+  } while (time-ctx.last_time < (unsigned long)ctx.ms_delay);
   
   // loop 200? 60? times per second?
   // The point is, we want light adjustments to be constant regardless of how much processing is going on.
 #if (DEBUG!=DEBUG_OFF)
-  static int i=0;
-  static float avg_loop_time = 0;
-  avg_loop_time = (avg_loop_time*29 + time-last_time)/30;
-#if (DEBUG==DEBUG_LOOP)
-  if(!i) {
-    Serial.print("Average loop time: ");
-    Serial.println(avg_loop_time);
-  }
-#endif
-  if(avg_loop_time>ms_delay+1 && !i) {
-    // This may be caused by too much processing for our ms_delay, or by too many print statements (each one takes a few ms)
-    Serial.print("WARNING: loop time: ");
-    Serial.println(avg_loop_time);
-  }
-  if (!i)
-    i=1000/ms_delay; // display loop output every second
+  ctx.avg_loop_time = (ctx.avg_loop_time*29 + time-ctx.last_time)/30;
+  if(!ctx.loop_report_wait && (DEBUG==DEBUG_LOOP || ctx.avg_loop_time>ctx.ms_delay+1)) {
+    // Running late may be caused by too much processing for our ms_delay, or by too many print statements (each one takes a few ms)
+    log_event(EVENT_LOOP_TIME, ctx.avg_loop_time*10);
+  }
+  if (!ctx.loop_report_wait)
+    ctx.loop_report_wait=1000/ctx.ms_delay; // display loop output every second
   else
-    i--;
+    ctx.loop_report_wait--;
+  send_events();
+#endif
+#ifdef TELEMETRY
+  send_telemetry(); // the state at the end of the last update
 #endif
 
-  last_time = time;
+  ctx.last_time = time;
   // power saving modes described here: http://www.atmel.com/Images/2545s.pdf
-  //run overheat protection, time display, track battery usage
+}
 
-#ifdef LED  
+#ifdef LED
+void hexbright::update_leds() {
   // regardless of desired led state, turn it off so we can read the button
   _led_off(RLED);
   read_button();
   // turn on (or off) the leds, if appropriate
   adjust_leds();
-#ifdef PRINT_NUMBER
-  update_number();
-#endif
-#else
-  read_button();
-#endif
-  
-  read_thermal_sensor(); // takes about .2 ms to execute (fairly long, relative to the other steps)
-#ifdef ACCELEROMETER
-  read_accelerometer_vector();
+}
 #endif
+
+void hexbright::update_light() {
   overheat_protection();    
+  low_battery_protection();
   
   // change light levels as requested
   adjust_light(); 
 }
 
 void hexbright::shutdown() {
+  ctx.shut_down = true;
+  ctx.light_on = false;
   pinMode(DPIN_PWR, OUTPUT);
   digitalWrite(DPIN_PWR, LOW);
+  TIMSK1 &= ~_BV(OCIE1A); // drop any staged mode change
   digitalWrite(DPIN_DRV_MODE, LOW);
   digitalWrite(DPIN_DRV_EN, LOW);
 }
 
 
+///////////////////////////////////////////////
+/////////////////DEBUG EVENTS//////////////////
+///////////////////////////////////////////////
+
+#if (DEBUG!=DEBUG_OFF)
+#define EVENT_FRAME_START 0xA5
+#define EVENT_FRAME_BYTES 6
+#define EVENT_SLOT(i) ((i) & (DEBUG_EVENT_SLOTS-1))
+
+static void push_event(byte id, int value) {
+  debug_event* e = &ctx.event_ring[ctx.event_head];
+  e->id = id;
+  e->tick = ctx.event_tick;
+  e->value = value;
+  ctx.event_head = EVENT_SLOT(ctx.event_head+1);
+}
+
+void hexbright::log_event(byte id, int value) {
+  byte free_slots = DEBUG_EVENT_SLOTS-1 - EVENT_SLOT(ctx.event_head-ctx.event_tail);
+  // after a drop, an event only goes in if there's also room to report the drop
+  if(free_slots < (ctx.events_dropped ? 2 : 1)) {
+    if(ctx.events_dropped<255)
+      ctx.events_dropped++;
+    return;
+  }
+  if(ctx.events_dropped) {
+    push_event(EVENT_DROPPED, ctx.events_dropped);
+    ctx.events_dropped = 0;
+  }
+  push_event(id, value);
+}
+
+void hexbright::send_events() {
+  // whole frames only, and no more than the port can send before the next
+  //  update (or the 64 byte Serial buffer holds), so write() never waits
+  int budget = min((long)DEBUG_BAUD/10*ctx.ms_delay/1000, 60);
+  while(ctx.event_tail!=ctx.event_head && budget>=EVENT_FRAME_BYTES) {
+    debug_event* e = &ctx.event_ring[ctx.event_tail];
+    byte frame[EVENT_FRAME_BYTES] = {EVENT_FRAME_START, e->id, e->tick, lowByte(e->value), highByte(e->value)};
+    frame[EVENT_FRAME_BYTES-1] = e->id + e->tick + frame[3] + frame[4];
+    Serial.write(frame, EVENT_FRAME_BYTES);
+    ctx.event_tail = EVENT_SLOT(ctx.event_tail+1);
+    budget -= EVENT_FRAME_BYTES;
+  }
+  ctx.event_tick++;
+}
+#endif
 
 
 ///////////////////////////////////////////////
@@ -170,46 +505,58 @@ void hexbright::shutdown() {
 // This is handled inside of set_light_level.
 
 
-int start_light_level = 0;
-int end_light_level = 0;
-int change_duration = 0;
-int change_done  = 0;
-
-int safe_light_level = MAX_LEVEL;
-
 
 void hexbright::set_light(int start_level, int end_level, int time) {
+  set_light_ticks(start_level, end_level, time/ctx.ms_delay);
+}
+
+void hexbright::set_light_ticks(int start_level, int end_level, int ticks) {
 // duration ranges from 1-MAXINT
 // light_level can be from 0-1000
   if(start_level == CURRENT_LEVEL) {
-    start_light_level = get_safe_light_level();
-    end_light_level = end_level;
+    // the requested level, capped, but not battery compensated: that's 
+    //  applied to each step of the ramp, and would otherwise compound
+    ctx.start_light_level = cap_light_level(get_light_level());
+    ctx.end_light_level = end_level;
   } else {
-    start_light_level = start_level;
-    end_light_level = end_level;
+    ctx.start_light_level = start_level;
+    ctx.end_light_level = end_level;
   }
 
-  change_duration = time/ms_delay;
-  change_done = 0;
+  ctx.change_duration = ticks;
+  ctx.change_done = 0;
+  ctx.shut_down = false;
 #if (DEBUG==DEBUG_LIGHT)
-  Serial.print("Light adjust requested, start level:");
-  Serial.println(start_light_level);
+  log_event(EVENT_LIGHT_REQUEST, ctx.start_light_level);
 #endif
 
 }
 
 int hexbright::get_light_level() {
-  if(change_done>=change_duration)
-    return end_light_level;
+  if(ctx.change_done>=ctx.change_duration)
+    return ctx.end_light_level;
   else 
-    return (end_light_level-start_light_level)*((float)change_done/change_duration) +start_light_level; 
+    return (ctx.end_light_level-ctx.start_light_level)*((float)ctx.change_done/ctx.change_duration) +ctx.start_light_level; 
 }
 
 int hexbright::get_safe_light_level() {
   int light_level = get_light_level();
 
-  if(light_level>safe_light_level)
-     return safe_light_level;
+#ifdef BATTERY_COMPENSATION
+  if(ctx.battery_mv && ctx.battery_mv<BATTERY_FULL_MV) {
+    light_level += (long)light_level*(BATTERY_FULL_MV-ctx.battery_mv)*BATTERY_COMPENSATION/10000;
+    light_level = light_level > MAX_LEVEL ? MAX_LEVEL : light_level;
+  }
+#endif
+  return cap_light_level(light_level);
+}
+
+// overheat and low battery protection
+int hexbright::cap_light_level(int light_level) {
+  if(light_level>ctx.battery_light_level)
+     light_level = ctx.battery_light_level;
+  if(light_level>ctx.safe_light_level)
+     return ctx.safe_light_level;
   return light_level;
 }
 
@@ -217,38 +564,110 @@ int hexbright::get_safe_light_level() {
 void hexbright::set_light_level(unsigned long level) {
 // LOW 255 approximately equals HIGH 48/49.  There is a color change.  
 // Values < 4 do not provide any light.
-// I don't know about relative power draw.
 
 // look at linearity_test.ino for more detail on these algorithms.
 
 #if (DEBUG==DEBUG_LIGHT)
-  Serial.print("light level: ");
-  Serial.println(level);
+  log_event(EVENT_LIGHT_LEVEL, level);
 #endif
   pinMode(DPIN_PWR, OUTPUT);
   digitalWrite(DPIN_PWR, HIGH);
+  ctx.light_on = level>0;
+  // output, in LOW pwm steps
+  int output;
   if(level == 0) {
   // lowest possible power, but still running (DPIN_PWR still high)
-    digitalWrite(DPIN_DRV_MODE, LOW);
-    analogWrite(DPIN_DRV_EN, 0); 
+    output = 0;
   }
   else if(level<=500) {
-    digitalWrite(DPIN_DRV_MODE, LOW);
-    analogWrite(DPIN_DRV_EN, .000000633*(level*level*level)+.000632*(level*level)+.0285*level+3.98);
+    output = .000000633*(level*level*level)+.000632*(level*level)+.0285*level+3.98;
   } else {
     level -= 500;
-    digitalWrite(DPIN_DRV_MODE, HIGH);
-    analogWrite(DPIN_DRV_EN, .00000052*(level*level*level)+.000365*(level*level)+.108*level+44.8);
-  }  
+    output = (.00000052*(level*level*level)+.000365*(level*level)+.108*level+44.8)*DRV_HIGH_RATIO/100;
+  }
+
+  int high_pwm = ((long)output*100+DRV_HIGH_RATIO/2)/DRV_HIGH_RATIO;
+  byte mode = ctx.driver_mode;
+  if(output == 0) {
+    mode = LOW;
+  } else if(output > 255) { // only HIGH is bright enough
+    mode = HIGH;
+  } else if(high_pwm < 4) { // HIGH can't go this dim
+    mode = LOW;
+  } else {
+    int low_ma = driver_ma(LOW, output);
+    int high_ma = driver_ma(HIGH, high_pwm);
+    // up into HIGH only once it's DRV_MODE_HYSTERESIS percent cheaper, but 
+    //  back to LOW as soon as that's cheaper, so the hysteresis band is all 
+    //  above the crossover and HIGH is never used below it
+    if(mode==LOW && (long)high_ma*100 < (long)low_ma*(100-DRV_MODE_HYSTERESIS))
+      mode = HIGH;
+    else if(mode==HIGH && low_ma <= high_ma)
+      mode = LOW;
+  }
+  byte pwm = mode==HIGH ? min(high_pwm, 255) : output;
+#if (DEBUG==DEBUG_LIGHT)
+  log_event(EVENT_DRIVER, mode<<8 | pwm);
+#endif
+  commit_driver(mode, pwm);
+}
+
+// Writing the mode pin and then the pwm (or the reverse) leaves a moment of
+//  new mode with old duty, a visible flash when a ramp crosses modes.  Timer1 
+//  runs phase correct 8 bit pwm (as Arduino sets it up), which loads OCR1B 
+//  from its buffer at the top of the count, so the new duty always starts 
+//  there.  The mode pin is switched in the same place, from the OCR1A match 
+//  (OCR1A is 255 and otherwise unused, DPIN_DRV_MODE isn't a pwm output).
+//  The overflow interrupt would be half a period off, at the bottom.
+void hexbright::commit_driver(byte mode, byte pwm) {
+  TCCR1A |= _BV(COM1B1); // digitalWrite (in init and shutdown) disconnects the pwm
+  cli();
+  ctx.driver_mode = mode;
+  ctx.driver_pwm = pwm;
+  if(((PORTB & DRV_MODE_BIT) ? HIGH : LOW) != mode) {
+    // clear an old match before writing OCR1B, so the match we act on is 
+    //  at (or after) the top that loads it
+    TIFR1 = _BV(OCF1A);
+    TIMSK1 |= _BV(OCIE1A);
+  }
+  OCR1B = pwm; // 0 is always off and 255 always on, no special cases like analogWrite
+  sei();
+}
+
+ISR(TIMER1_COMPA_vect) {
+  // the new OCR1B was just loaded
+  if(ctx.driver_mode==HIGH)
+    PORTB |= DRV_MODE_BIT;
+  else
+    PORTB &= ~DRV_MODE_BIT;
+  TIMSK1 &= ~_BV(OCIE1A);
+}
+
+// Battery current (mA) for each driver mode, at pwm 0, 32, 64 ... 256.  LOW
+//  pulses the LED at a lower current, where it's more efficient, so it wins
+//  wherever it's bright enough.
+// ESTIMATES, not measurements: HIGH is LOW scaled by DRV_HIGH_RATIO, less a
+//  guessed few percent for LOW's efficiency, and nobody has put an ammeter 
+//  on either yet.  Measure your own with linearity_test and an ammeter on
+//  the battery for better mode choices (and a better battery sag estimate).
+const int low_mode_ma[] PROGMEM = {2, 40, 78, 115, 152, 188, 224, 260, 296};
+const int high_mode_ma[] PROGMEM = {5, 215, 420, 620, 815, 1005, 1190, 1370, 1545};
+
+int hexbright::driver_ma(byte mode, int pwm) {
+  const int* table = mode==HIGH ? high_mode_ma : low_mode_ma;
+  byte i = pwm>>5;
+  int low = pgm_read_word(&table[i]);
+  int high = pgm_read_word(&table[i+1]);
+  return low + ((high-low)*(pwm&31)>>5);
 }
 
 void hexbright::adjust_light() {
   // sets actual light level, altering value to be perceptually linear, based on steven's area brightness (cube root)
-  if(change_done<=change_duration) {
+  if(ctx.change_done<=ctx.change_duration) {
     int light_level = hexbright::get_safe_light_level();
     set_light_level(light_level);
 
-    change_done++;
+    ctx.change_done++;
   }
 }
 
@@ -259,38 +678,64 @@ void hexbright::adjust_light() {
 void hexbright::overheat_protection() {
   int temperature = get_thermal_sensor();
   
-  safe_light_level = safe_light_level+(OVERHEAT_TEMPERATURE-temperature);
+  ctx.safe_light_level = ctx.safe_light_level+(ctx.overheat_temperature-temperature);
   // min, max levels...
-  safe_light_level = safe_light_level > MAX_LEVEL ? MAX_LEVEL : safe_light_level;
-  safe_light_level = safe_light_level < 0 ? 0 : safe_light_level;
+  ctx.safe_light_level = ctx.safe_light_level > MAX_LEVEL ? MAX_LEVEL : ctx.safe_light_level;
+  ctx.safe_light_level = ctx.safe_light_level < 0 ? 0 : ctx.safe_light_level;
 #if (DEBUG==DEBUG_TEMP)
-  static float printed_temperature = 0;
-  static float average_temperature = -1;
-  if(average_temperature < 0) {
-    average_temperature = temperature;
-    Serial.println("Have you calibrated your thermometer?");
-    Serial.println("Instructions are in get_celsius.");
-  }
-  average_temperature = (average_temperature*4+temperature)/5;
-  if (abs(printed_temperature-average_temperature)>1) {
-    printed_temperature = average_temperature;
-    Serial.print("Current average reading: ");
-    Serial.print(printed_temperature);
-    Serial.print(" (celsius: ");
-    Serial.print(get_celsius());
-    Serial.print(") (fahrenheit: ");
-    Serial.print(get_fahrenheit());
-    Serial.println(")");
-    }
+  // the reading is already filtered (THERMAL_FILTER_SHIFT)
+  if(temperature != ctx.logged_temperature) {
+    ctx.logged_temperature = temperature;
+    log_event(EVENT_TEMPERATURE, temperature);
+  }
 #endif
 
   // if safe_light_level has changed, guarantee a light adjustment:
-  if(safe_light_level < MAX_LEVEL) {
+  if(ctx.safe_light_level < MAX_LEVEL) {
 #if (DEBUG!=DEBUG_OFF)
-    Serial.print("Estimated safe light level: ");
-    Serial.println(safe_light_level);
+    log_event(EVENT_SAFE_LEVEL, ctx.safe_light_level);
+#endif
+    ctx.change_done  = min(ctx.change_done , ctx.change_duration);
+  }
+}
+
+int hexbright::battery_cap(int mv) {
+  if(mv>=LOW_BATTERY_MV)
+    return MAX_LEVEL;
+  if(mv<=CRITICAL_BATTERY_MV)
+    return LOW_BATTERY_MIN_LEVEL;
+  return LOW_BATTERY_MIN_LEVEL + 
+    (long)(MAX_LEVEL-LOW_BATTERY_MIN_LEVEL)*(mv-CRITICAL_BATTERY_MV)/(LOW_BATTERY_MV-CRITICAL_BATTERY_MV);
+}
+
+// get_battery_mv is load compensated, so dimming the light doesn't raise the
+//  reading and undo itself.  The cap moves one level per update, like 
+//  overheat protection, so a step down is gradual.
+void hexbright::low_battery_protection() {
+#ifdef BATTERY_COMPENSATION
+  int last_mv = ctx.battery_mv;
+#endif
+  ctx.battery_mv = get_battery_mv();
+  int old_level = ctx.battery_light_level;
+  if(get_definite_charge_state()!=BATTERY || !ctx.battery_mv) {
+    // plugged in (or no reading yet), the driver has all the power it needs
+    ctx.battery_light_level = MAX_LEVEL;
+  } else if(ctx.battery_light_level > battery_cap(ctx.battery_mv)) {
+    ctx.battery_light_level--;
+  } else if(ctx.battery_light_level < battery_cap(ctx.battery_mv-LOW_BATTERY_HYSTERESIS_MV)) {
+    ctx.battery_light_level++;
+  }
+
+  // if the cap (or the compensation) has changed, guarantee a light adjustment:
+  if(ctx.battery_light_level!=old_level
+#ifdef BATTERY_COMPENSATION
+     || ctx.battery_mv!=last_mv
+#endif
+     ) {
+#if (DEBUG==DEBUG_BATTERY)
+    log_event(EVENT_BATTERY_LEVEL, ctx.battery_light_level);
 #endif
-    change_done  = min(change_done , change_duration);
+    ctx.change_done  = min(ctx.change_done , ctx.change_duration);
   }
 }
 
@@ -300,26 +745,25 @@ void hexbright::overheat_protection() {
 
 #ifdef LED
 
-// >0 = countdown, 0 = change state, -1 = state changed
-int led_wait_time[2] = {-1, -1};
-int led_on_time[2] = {-1, -1};
-byte led_brightness[2] = {0, 0};
-
 void hexbright::set_led(byte led, int on_time, int wait_time, byte brightness) {
+  set_led_ticks(led, on_time/ctx.ms_delay, wait_time/ctx.ms_delay, brightness);
+}
+
+void hexbright::set_led_ticks(byte led, int on_ticks, int wait_ticks, byte brightness) {
 #if (DEBUG==DEBUG_LED)
-  Serial.println("activate led");
+  log_event(EVENT_SET_LED, led<<8 | (byte)on_ticks);
 #endif
-  led_on_time[led] = on_time/ms_delay;
-  led_wait_time[led] = wait_time/ms_delay;
-  led_brightness[led] = brightness;
+  ctx.led_on_time[led] = on_ticks;
+  ctx.led_wait_time[led] = wait_ticks;
+  ctx.led_brightness[led] = brightness;
 }
 
 
 byte hexbright::get_led_state(byte led) {
   //returns true if the LED is on
-  if(led_on_time[led]>=0) {
+  if(ctx.led_on_time[led]>=0) {
     return LED_ON;
-  } else if(led_wait_time[led]>0) {
+  } else if(ctx.led_wait_time[led]>0) {
     return LED_WAIT;
   } else {
     return LED_OFF;
@@ -328,10 +772,10 @@ byte hexbright::get_led_state(byte led) {
 
 inline void hexbright::_led_on(byte led) {
   if(led == RLED) { // DPIN_RLED_SW
-    analogWrite(DPIN_RLED_SW, led_brightness[RLED]);
+    analogWrite(DPIN_RLED_SW, ctx.led_brightness[RLED]);
     pinMode(DPIN_RLED_SW, OUTPUT);
   } else { // DPIN_GLED
-    analogWrite(DPIN_GLED, led_brightness[GLED]);
+    analogWrite(DPIN_GLED, ctx.led_brightness[GLED]);
   }
 }
 
@@ -347,31 +791,24 @@ inline void hexbright::_led_off(byte led) {
 inline void hexbright::adjust_leds() {
   // turn off led if it's expired
 #if (DEBUG==DEBUG_LED)
-  if(led_on_time[GLED]>=0) {
-    Serial.print("green on countdown: ");
-    Serial.println(led_on_time[GLED]*ms_delay);
-  } else if (led_on_time[GLED]<0 && led_wait_time[GLED]>=0) {
-    Serial.print("green wait countdown: ");
-    Serial.println((led_wait_time[GLED])*ms_delay);
-  }
-  if(led_on_time[RLED]>=0) {
-    Serial.print("red on countdown: ");
-    Serial.println(led_on_time[RLED]*ms_delay);
-  } else if (led_on_time[RLED]<0 && led_wait_time[RLED]>=0) {
-    Serial.print("red wait countdown: ");
-    Serial.println((led_wait_time[RLED])*ms_delay);
-  }
-#endif
-  int i=0;
+  if(ctx.led_on_time[GLED]>=0)
+    log_event(EVENT_GLED, ctx.led_on_time[GLED]*ctx.ms_delay);
+  else if (ctx.led_wait_time[GLED]>=0)
+    log_event(EVENT_GLED, -ctx.led_wait_time[GLED]*ctx.ms_delay);
+  if(ctx.led_on_time[RLED]>=0)
+    log_event(EVENT_RLED, ctx.led_on_time[RLED]*ctx.ms_delay);
+  else if (ctx.led_wait_time[RLED]>=0)
+    log_event(EVENT_RLED, -ctx.led_wait_time[RLED]*ctx.ms_delay);
+#endif
   for(int i=0; i<2; i++) {
-    if(led_on_time[i]>0) {
+    if(ctx.led_on_time[i]>0) {
       _led_on(i);
-      led_on_time[i]--;
-    } else if(led_on_time[i]==0) {
+      ctx.led_on_time[i]--;
+    } else if(ctx.led_on_time[i]==0) {
       _led_off(i);
-	  led_on_time[i]--;
-    } else if (led_wait_time[i]>=0) {
-      led_wait_time[i]--;
+	  ctx.led_on_time[i]--;
+    } else if (ctx.led_wait_time[i]>=0) {
+      ctx.led_wait_time[i]--;
     }
   }
 }
@@ -382,37 +819,187 @@ inline void hexbright::adjust_leds() {
 /////////////////////BUTTON////////////////////
 ///////////////////////////////////////////////
 
-int time_held = 0;
-boolean released = true;
-
 boolean hexbright::button_released() {
-  return time_held && released;
+  return ctx.time_held && ctx.released;
 }
 
 int hexbright::button_held() {
-  return time_held*ms_delay;// && !red_on_time; 
+  return ctx.time_held*ctx.ms_delay;// && !red_on_time; 
+}
+
+int hexbright::button_held_ticks() {
+  return ctx.time_held;
 }
 
 void hexbright::read_button() {
   byte button_on = digitalRead(DPIN_RLED_SW);
   if(button_on) {
 #if (DEBUG==DEBUG_BUTTON)
-    if(released)
-      Serial.println("Button pressed");
+    if(ctx.released)
+      log_event(EVENT_BUTTON_PRESS, 0);
 #endif
-    time_held++; 
-    released = false;
-  } else if (released && time_held) { // we've given a chance for the button press to be read, reset time_held
+    ctx.time_held++; 
+    ctx.released = false;
+    ctx.shut_down = false;
+  } else if (ctx.released && ctx.time_held) { // we've given a chance for the button press to be read, reset time_held
 #if (DEBUG==DEBUG_BUTTON)
-    Serial.print("time_held: ");
-    Serial.println(time_held*ms_delay);
+    log_event(EVENT_BUTTON_RELEASE, ctx.time_held*ctx.ms_delay);
 #endif
-    time_held = 0; 
+    ctx.time_held = 0; 
   } else {
-    released = true;
+    // sketches often shutdown() until the button is let go, so waking on 
+    //  the press isn't enough (see update_accelerometer_mode)
+    if(!ctx.released)
+      ctx.shut_down = false;
+    ctx.released = true;
+  }
+}
+
+
+///////////////////////////////////////////////
+/////////////////////TWI///////////////////////
+///////////////////////////////////////////////
+
+#ifdef ACCELEROMETER
+
+// Interrupt driven i2c.  Wire blocks until each transaction is finished,
+//  this lets us start a read at the end of one update and pick up the
+//  result at the start of the next.  Don't include Wire.h alongside this,
+//  only one of us can own the TWI interrupt.
+// ATmega168 data sheet, chapter 21: http://www.atmel.com/Images/doc2545.pdf
+
+#define TWI_FREQUENCY 400000L
+#define TWI_TIMEOUT_US 1000 // longest we'll wait for a transaction to finish
+
+#define TWI_IDLE 0
+#define TWI_BUSY 1
+#define TWI_DONE 2
+#define TWI_NACK 3  // nobody answered, the bus is fine
+#define TWI_ERROR 4 // bus error, lost arbitration or timed out; the bus needs to be recovered
+
+#define TWI_CONTINUE (_BV(TWINT) | _BV(TWEN) | _BV(TWIE))
+
+void twi_init() {
+  // internal pull-ups, as Wire does
+  digitalWrite(DPIN_SDA, HIGH);
+  digitalWrite(DPIN_SCL, HIGH);
+  TWSR = 0; // prescaler 1
+  TWBR = ((F_CPU/TWI_FREQUENCY)-16)/2;
+  TWCR = _BV(TWEN);
+  ctx.twi_state = TWI_IDLE;
+}
+
+// Free a bus that a slave is holding, then start over.  If we reset in the 
+//  middle of a read, the accelerometer may still be driving SDA low.  Clock 
+//  SCL until it lets go, then send a STOP.
+void twi_recover() {
+  TWCR = 0; // release the pins
+  pinMode(DPIN_SDA, INPUT);
+  digitalWrite(DPIN_SDA, HIGH);
+  for(int i=0; i<9 && !digitalRead(DPIN_SDA); i++) {
+    digitalWrite(DPIN_SCL, LOW);
+    pinMode(DPIN_SCL, OUTPUT);
+    delayMicroseconds(5);
+    pinMode(DPIN_SCL, INPUT);
+    digitalWrite(DPIN_SCL, HIGH);
+    delayMicroseconds(5);
+  }
+  // STOP: SDA goes high while SCL is high
+  digitalWrite(DPIN_SDA, LOW);
+  pinMode(DPIN_SDA, OUTPUT);
+  delayMicroseconds(5);
+  pinMode(DPIN_SDA, INPUT);
+  digitalWrite(DPIN_SDA, HIGH);
+  twi_init();
+}
+
+// Writes write_count bytes of twi_buffer, then (after a repeated start) 
+//  reads read_count bytes into twi_buffer.  Returns immediately; use
+//  twi_finish() to get the result.
+void twi_start(byte address, byte write_count, byte read_count) {
+  // let the last STOP finish going out
+  for(byte i=0; (TWCR & _BV(TWSTO)) && i<200; i++);
+  ctx.twi_address = address;
+  ctx.twi_write_count = write_count;
+  ctx.twi_read_count = read_count;
+  ctx.twi_state = TWI_BUSY;
+  TWCR = TWI_CONTINUE | _BV(TWSTA);
+}
+
+// Wait (at most TWI_TIMEOUT_US) for the current transaction.  Returns true if 
+//  it succeeded, recovering the bus if it didn't.
+boolean twi_finish() {
+  unsigned long start = micros();
+  while(ctx.twi_state == TWI_BUSY) {
+    if(micros()-start > TWI_TIMEOUT_US) {
+      ctx.twi_state = TWI_ERROR;
+      break;
+    }
+  }
+  byte state = ctx.twi_state;
+  if(state == TWI_ERROR)
+    twi_recover();
+  ctx.twi_state = TWI_IDLE;
+  return state == TWI_DONE;
+}
+
+boolean twi_busy() {
+  return ctx.twi_state == TWI_BUSY;
+}
+
+void twi_stop(byte state) {
+  TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO);
+  ctx.twi_state = state;
+}
+
+ISR(TWI_vect) {
+  switch(TWSR & 0xF8) { // status codes, data sheet page 229
+  case 0x08: // START sent
+    ctx.twi_index = 0;
+    TWDR = ctx.twi_address<<1; // SLA+W
+    TWCR = TWI_CONTINUE;
+    break;
+  case 0x10: // repeated START sent
+    ctx.twi_index = 0;
+    TWDR = (ctx.twi_address<<1) | 1; // SLA+R
+    TWCR = TWI_CONTINUE;
+    break;
+  case 0x18: // SLA+W acked
+  case 0x28: // data byte acked
+    if(ctx.twi_index < ctx.twi_write_count) {
+      TWDR = ctx.twi_buffer[ctx.twi_index++];
+      TWCR = TWI_CONTINUE;
+    } else if(ctx.twi_read_count) {
+      TWCR = TWI_CONTINUE | _BV(TWSTA);
+    } else {
+      twi_stop(TWI_DONE);
+    }
+    break;
+  case 0x50: // data byte received, acked
+    ctx.twi_buffer[ctx.twi_index++] = TWDR;
+    // fall through
+  case 0x40: // SLA+R acked
+    // ack every byte but the last
+    if(ctx.twi_index+1 < ctx.twi_read_count)
+      TWCR = TWI_CONTINUE | _BV(TWEA);
+    else
+      TWCR = TWI_CONTINUE;
+    break;
+  case 0x58: // last data byte received, nacked
+    ctx.twi_buffer[ctx.twi_index++] = TWDR;
+    twi_stop(TWI_DONE);
+    break;
+  case 0x20: // SLA+W nacked
+  case 0x30: // data byte nacked
+  case 0x48: // SLA+R nacked
+    twi_stop(TWI_NACK);
+    break;
+  default: // bus error, lost arbitration
+    twi_stop(TWI_ERROR);
   }
 }
 
+#endif
 
 ///////////////////////////////////////////////
 ////////////////ACCELEROMETER//////////////////
@@ -429,38 +1016,32 @@ void hexbright::read_button() {
 #define ACCEL_DROP   3 // return change of velocity - period of no acceleration before impact?
 #define ACCEL_TAP    4 // return change of velocity - acceleration before impact
 
-boolean using_accelerometer = false;
-
+#define GRAVITY_SQUARED 454 // 1 G = 21.3, squared
+#define GRAVITY_FRACTION_BITS 6
 
 
-double vectors[] = {0,0,0, 0,0,0};
-double* new_vector = vectors;
-double* old_vector = vectors+3;
-double down[3] = {0,0,0};
+// ms between samples for each rate
+const int acc_rate_period[] PROGMEM = {8, 16, 31, 63, 125, 250, 500, 1000};
 
-double old_magnitude = 0;
-double new_magnitude = 0;
-double dp = 0;
-double angle_change = 0;
-double axes_rotation[] = {0,0,0};
-
-double light_axis[3] = {0,-1,0};
+void accelerometer_interrupt() {
+  acc_ctx.acc_interrupt = true;
+}
 
 
 double hexbright::get_angle_change() {
-  return angle_change;
+  return acc_ctx.angle_change;
 }
 
 double hexbright::get_dp() {
-  return dp;
+  return acc_ctx.dp;
 }
 
 double* hexbright::get_axes_rotation() {
-  return axes_rotation;
+  return acc_ctx.axes_rotation;
 }
 
 double hexbright::get_gs() {
-  return new_magnitude;
+  return acc_ctx.new_magnitude;
 }
 
 void hexbright::normalize(double* out_vector, double* in_vector, double magnitude) {
@@ -471,41 +1052,103 @@ void hexbright::normalize(double* out_vector, double* in_vector, double magnitud
 
 
 double hexbright::jab_detect(float sensitivity) {
-#if (DEBUG==DEBUG_ACCEL)
-  //Serial.println((int)sensitivity);
-#endif
   double new_normalized[3] = {0,0,0};
   double old_normalized[3] = {0,0,0};
-  normalize(new_normalized, new_vector, new_magnitude);
-  normalize(old_normalized, old_vector, old_magnitude);
+  normalize(new_normalized, acc_ctx.new_vector, acc_ctx.new_magnitude);
+  normalize(old_normalized, acc_ctx.old_vector, acc_ctx.old_magnitude);
   
   //  if(abs(old_magnitude-1)>.3 && abs(new_magnitude-1)>.3) {
-  if(abs(old_magnitude-new_magnitude)>.4) {
+  if(abs(acc_ctx.old_magnitude-acc_ctx.new_magnitude)>.4) {
 #if (DEBUG==DEBUG_ACCEL)
-    Serial.println("magnitude passed");
-    Serial.println(abs(dot_product(new_normalized, light_axis)));
-    Serial.println(abs(dot_product(old_normalized, light_axis)));
+    log_event(EVENT_JAB_AXIS, (byte)(abs(dot_product(new_normalized, acc_ctx.light_axis))*100)<<8 |
+                              (byte)(abs(dot_product(old_normalized, acc_ctx.light_axis))*100));
 #endif
-     if(abs(dot_product(new_normalized, light_axis))>.8 &&
-        abs(dot_product(old_normalized, light_axis))>.8) {
+     if(abs(dot_product(new_normalized, acc_ctx.light_axis))>.8 &&
+        abs(dot_product(old_normalized, acc_ctx.light_axis))>.8) {
 #if (DEBUG==DEBUG_ACCEL)
-       Serial.println("light_axis passed");
-       Serial.println(new_vector[1]);
+       log_event(EVENT_JAB, acc_ctx.new_vector[1]-20);
 #endif
-        return new_vector[1]-20;
+        return acc_ctx.new_vector[1]-20;
      }
   }
   return 0;
+}
 
-  // magnitude(old_thing, new_thing
-  if(angle_change>15 && abs(new_magnitude-1)>.4) {
-    
-    //    print_vector(normalized);
-    //    Serial.println("normalized");
-    //Serial.println(dot_product(normalized,light_axis));
-    return 1;
+char hexbright::match_gesture(const gesture* templates, byte count, int threshold) {
+  // the recent motion, with gravity taken out
+  char window[GESTURE_LENGTH][3];
+  for(int i=0; i<GESTURE_LENGTH; i++) {
+    for(int j=0; j<3; j++) {
+      window[i][j] = get_accel_sample(GESTURE_LENGTH-1-i, j) - (acc_ctx.gravity[j]>>GRAVITY_FRACTION_BITS);
+    }
   }
-  return 0;
+  char best = -1;
+  long best_score = threshold; // percent of the template's size
+  for(int i=0; i<count; i++) {
+    // the template's size is its distance from holding still
+    int size = 0;
+    for(int j=0; j<GESTURE_LENGTH; j++) {
+      for(int k=0; k<3; k++) {
+        size += abs((char)pgm_read_byte(&templates[i][j][k]));
+      }
+    }
+    if(!size)
+      continue;
+    int distance = gesture_distance(window, templates+i, (long)size*best_score/100);
+    long score = (long)distance*100/size;
+    if(score < best_score) {
+      best_score = score;
+      best = i;
+    }
+  }
+#if (DEBUG==DEBUG_ACCEL)
+  if(best>=0) {
+    log_event(EVENT_GESTURE, best<<8 | (byte)min(best_score, 255));
+  }
+#endif
+  return best;
+}
+
+int hexbright::gesture_distance(char (*window)[3], const gesture* gesture_template, int limit) {
+  // dynamic time warping, limited to a band of GESTURE_BAND samples around 
+  //  the diagonal.  Only two rows of the cost matrix are kept.
+  const int infinity = 0x7FFF;
+  int rows[2][GESTURE_LENGTH];
+  int* previous = rows[0];
+  int* current = rows[1];
+  for(int i=0; i<GESTURE_LENGTH; i++) {
+    int row_min = infinity;
+    for(int j=0; j<GESTURE_LENGTH; j++) {
+      current[j] = infinity;
+    }
+    for(int j=max(0, i-GESTURE_BAND); j<=min(GESTURE_LENGTH-1, i+GESTURE_BAND); j++) {
+      int best = infinity;
+      if(i==0 && j==0) {
+        best = 0;
+      } else {
+        if(i>0)
+          best = min(best, previous[j]);
+        if(i>0 && j>0)
+          best = min(best, previous[j-1]);
+        if(j>0)
+          best = min(best, current[j-1]);
+      }
+      if(best == infinity)
+        continue;
+      int cost = 0;
+      for(int k=0; k<3; k++) {
+        cost += abs(window[i][k] - (char)pgm_read_byte(&(*gesture_template)[j][k]));
+      }
+      current[j] = best + cost;
+      row_min = min(row_min, current[j]);
+    }
+    if(row_min >= limit) // it only gets worse from here
+      return infinity;
+    int* tmp = previous;
+    previous = current;
+    current = tmp;
+  }
+  return previous[GESTURE_LENGTH-1];
 }
 
 double hexbright::angle_difference(double dot_product, double magnitude1, double magnitude2) {
@@ -514,7 +1157,8 @@ double hexbright::angle_difference(double dot_product, double magnitude1, double
 }
 
 double hexbright::difference_from_down() {
-  return (angle_difference(dot_product(light_axis, down), 1, 1)/3.14159);
+  update_down();
+  return (angle_difference(dot_product(acc_ctx.light_axis, acc_ctx.down), 1, 1)/3.14159);
 }
 
 
@@ -522,26 +1166,27 @@ void hexbright::print_vector(double* vector, char* label) {
 #if (DEBUG!=DEBUG_OFF)
   for(int i=0; i<3; i++) {
     Serial.print(vector[i]); 
-    Serial.print("/");
+    Serial.print('/');
   }
   Serial.println(label);
 #endif
 }
 
 void hexbright::print_accelerometer() {
-#ifdef DEBUG // serial port is imported
-  print_vector(old_vector, "old vector");
-  print_vector(new_vector, "new vector");
-  print_vector(down, "down");
-  print_vector(axes_rotation, "axes rotation");
-  Serial.print(angle_change);
-  Serial.println(" (degrees)");
+#ifndef TELEMETRY // the serial port is taken
+  print_vector(acc_ctx.old_vector, "old vector");
+  print_vector(acc_ctx.new_vector, "new vector");
+  update_down();
+  print_vector(acc_ctx.down, "down");
+  print_vector(acc_ctx.axes_rotation, "axes rotation");
+  Serial.print(acc_ctx.angle_change);
+  Serial.println(F(" (degrees)"));
   Serial.print(difference_from_down());
-  Serial.println(" (difference from down)");
-  Serial.print("Magnitude (acceleration in Gs): ");
-  Serial.println(new_magnitude);
-  Serial.print("Dp: ");
-  Serial.println(dp);
+  Serial.println(F(" (difference from down)"));
+  Serial.print(F("Magnitude (acceleration in Gs): "));
+  Serial.println(acc_ctx.new_magnitude);
+  Serial.print(F("Dp: "));
+  Serial.println(acc_ctx.dp);
 #endif
 }
 
@@ -569,126 +1214,383 @@ void hexbright::sum_vectors(double* out_vector, double* in_vector1, double* in_v
 
 
 void hexbright::read_accelerometer_vector() {
+  // update() does this in the background, but sketches can also ask directly
+  if(acc_ctx.acc_read_start != ACC_REG_XOUT) {
+    collect_accelerometer();
+    begin_accelerometer_read(ACC_REG_XOUT);
+  }
+  collect_accelerometer();
+}
+
+void hexbright::start_accelerometer_read() {
+  // only read what the sketch is using, and only when there's a new sample
+  boolean sample_due = false;
+  acc_ctx.acc_wait_ms -= ctx.ms_delay;
+  if(acc_ctx.acc_wait_ms <= 0) {
+    acc_ctx.acc_wait_ms += pgm_read_word(&acc_rate_period[acc_ctx.acc_rate]);
+    acc_ctx.acc_wait_ms = max(acc_ctx.acc_wait_ms, 0); // updates are slower than samples
+    sample_due = true;
+  }
+  if((acc_ctx.acc_mode & ACC_USE_MOTION) && sample_due) {
+    // X, Y, Z and TILT in one transaction (the register address auto-increments)
+    begin_accelerometer_read(ACC_REG_XOUT);
+  } else if((acc_ctx.acc_mode & ACC_USE_EVENTS) && acc_ctx.acc_interrupt) {
+    begin_accelerometer_read(ACC_REG_TILT);
+  }
+}
+
+void hexbright::begin_accelerometer_read(byte acc_reg) {
+  // Reading TILT clears the interrupt.  Any reads run through TILT.
+  acc_ctx.acc_interrupt = false;
+  acc_ctx.acc_read_start = acc_reg;
+  ctx.twi_buffer[0] = acc_reg;
+  twi_start(ACC_ADDRESS, 1, ACC_REG_TILT+1-acc_reg);
+}
+
+void hexbright::collect_accelerometer() {
+  byte start = acc_ctx.acc_read_start;
+  if(start == ACC_NO_READ)
+    return;
+  acc_ctx.acc_read_start = ACC_NO_READ;
+  if(!twi_finish()) {
+    acc_ctx.acc_interrupt = true;
+    return; // keep the last readings
+  }
+  byte reading[4] = {0}; // only XOUT reads fill them all, and only those use them all
+  byte stale = 0; // bit i set = register i must be read again
+  for(int i=start; i<=ACC_REG_TILT; i++) {
+    reading[i] = ctx.twi_buffer[i-start];
+    if(reading[i] & 0x40) // Bx1xxxxx, the register was being updated, re-read per data sheet page 14
+      stale |= 1<<i;
+  }
+  for(byte tries=ACC_READ_RETRIES; stale && tries; tries--) {
+    for(int i=start; i<=ACC_REG_TILT; i++) {
+      if(stale & (1<<i)) {
+        reading[i] = read_accelerometer_register(i);
+        if(!(reading[i] & 0x40))
+          stale &= ~(1<<i);
+      }
+    }
+  }
+
+  if(stale & (1<<ACC_REG_TILT))
+    acc_ctx.acc_interrupt = true; // try again next update
+  else
+    update_tilt(reading[ACC_REG_TILT]);
+  if(start == ACC_REG_XOUT)
+    update_motion(reading, stale);
+}
+
+void hexbright::update_motion(byte* reading, byte stale) {
   // swap first vector
-  double* tmp_vector = new_vector;
-  new_vector = old_vector;
-  old_vector = tmp_vector;
-
-  while(1) {
-    Wire.beginTransmission(ACC_ADDRESS);
-    Wire.write(ACC_REG_XOUT);          // starting with ACC_REG_XOUT, 
-    Wire.endTransmission(false);
-    Wire.requestFrom(ACC_ADDRESS, 3);  // read 3 registers (X,Y,Z)
-    for(int i=0; i<3; i++) {
-      if (!Wire.available())
-        continue;
-      char tmp = Wire.read();
-      if(tmp & 0x40) // Bx1xxxxx, re-read per data sheet page 14
-        continue;
+  double* tmp_vector = acc_ctx.new_vector;
+  acc_ctx.new_vector = acc_ctx.old_vector;
+  acc_ctx.old_vector = tmp_vector;
+
+  for(int i=0; i<3; i++) {
+    if(!(stale & (1<<i))) { // otherwise keep the last good value
+      char tmp = reading[i];
       if(tmp & 0x20) // Bxx1xxxx, it's negative, extend the 6 bits to 8 bits
         tmp |= 0xC0;
-      new_vector[i] = tmp/21.3; // convert to Gs (datasheet page 28)
+      acc_ctx.acc_raw[i] = tmp;
     }
-    break;
+    acc_ctx.new_vector[i] = acc_ctx.acc_raw[i]/21.3; // convert to Gs (datasheet page 28)
   }
+  push_accel_sample(acc_ctx.acc_raw);
 
   // calculate Gs (magnitude)
-  old_magnitude = new_magnitude;
-  new_magnitude = get_magnitude(new_vector);
+  acc_ctx.old_magnitude = acc_ctx.new_magnitude;
+  acc_ctx.new_magnitude = get_magnitude(acc_ctx.new_vector);
 
   // calculate angle change
   // equation 45 from http://cache.freescale.com/files/sensors/doc/app_note/AN3461.pdf
-  dp = dot_product(old_vector, new_vector);
-  angle_change = angle_difference(dp,
-                                  new_magnitude, old_magnitude);
+  acc_ctx.dp = dot_product(acc_ctx.old_vector, acc_ctx.new_vector);
+  acc_ctx.angle_change = angle_difference(acc_ctx.dp,
+                                  acc_ctx.new_magnitude, acc_ctx.old_magnitude);
 
   // calculate instantaneous rotation around axes
   // equation 47 from http://cache.freescale.com/files/sensors/doc/app_note/AN3461.pdf
   for(int i=0; i<3; i++) {
-    axes_rotation[i] = (new_vector[(i+1)%3]*old_vector[(i+2)%3] \
-                        - new_vector[(i+2)%3]*old_vector[(i+1)%3]);
-    axes_rotation[i] /= new_magnitude*old_magnitude;
-    axes_rotation[i] /= asin(angle_change);
+    acc_ctx.axes_rotation[i] = (acc_ctx.new_vector[(i+1)%3]*acc_ctx.old_vector[(i+2)%3] \
+                        - acc_ctx.new_vector[(i+2)%3]*acc_ctx.old_vector[(i+1)%3]);
+    acc_ctx.axes_rotation[i] /= acc_ctx.new_magnitude*acc_ctx.old_magnitude;
+    acc_ctx.axes_rotation[i] /= asin(acc_ctx.angle_change);
   }
 
 
   // change angle_change from radians to degrees
-  angle_change *= 180/3.14159;  
+  acc_ctx.angle_change *= 180/3.14159;  
+
+  track_gravity();
+}
 
-  // find down
-  if(stationary()) { // update down
-    sum_vectors(down, new_vector, old_vector);
-    normalize(down, down, (new_magnitude+old_magnitude));
+void hexbright::track_gravity() {
+  // Low-pass filter the readings to find gravity.  The closer a reading is 
+  //  to 1 G, the more likely it is to be mostly gravity, so the more we 
+  //  trust it.  Readings far from 1 G (the light is being swung around) are ignored.
+  int magnitude_squared = 0;
+  for(int i=0; i<3; i++)
+    magnitude_squared += acc_ctx.acc_raw[i]*acc_ctx.acc_raw[i];
+  int error = abs(magnitude_squared - GRAVITY_SQUARED);
+  byte shift;
+  if(!acc_ctx.gravity_set) {
+    shift = 0; // start with the first reading
+    acc_ctx.gravity_set = true;
+  } else if(error < GRAVITY_SQUARED/8) { // within about 6% of 1 G
+    shift = acc_ctx.gravity_filter_shift;
+  } else if(error < GRAVITY_SQUARED/2) { // within about 30% of 1 G
+    shift = acc_ctx.gravity_filter_shift+2;
+  } else {
+    return;
+  }
+  for(int i=0; i<3; i++)
+    acc_ctx.gravity[i] += ((acc_ctx.acc_raw[i]<<GRAVITY_FRACTION_BITS) - acc_ctx.gravity[i]) >> shift;
+}
+
+void hexbright::update_down() {
+  double magnitude = 0;
+  for(int i=0; i<3; i++) {
+    acc_ctx.down[i] = acc_ctx.gravity[i];
+    magnitude += acc_ctx.down[i]*acc_ctx.down[i];
   }
+  if(magnitude>0)
+    normalize(acc_ctx.down, acc_ctx.down, sqrt(magnitude));
 }
 
 boolean hexbright::stationary(double tolerance) {
-  // low acceleration vectors, not much difference between vectors
-  return abs(new_magnitude-1)<tolerance && abs(old_magnitude-1)<tolerance; 
+  // average acceleration of about 1 G, and not much variation between samples.
+  //  everything is scaled by ACC_HISTORY^2 and worked from the raw sums, so 
+  //  nothing gets truncated along the way (n*sumsq-sum^2 is n^2 times the variance)
+  double raw_tolerance = tolerance*21.3*ACC_HISTORY;
+  long magnitude_squared = 0;
+  long variance = 0;
+  for(int i=0; i<3; i++) {
+    long sum = acc_ctx.acc_sum[i];
+    magnitude_squared += sum*sum;
+    variance += (long)acc_ctx.acc_sum_squares[i]*ACC_HISTORY - sum*sum;
+  }
+  double one_g = 21.3*ACC_HISTORY;
+  return variance < raw_tolerance*raw_tolerance &&
+    magnitude_squared > (one_g-raw_tolerance)*(one_g-raw_tolerance) &&
+    magnitude_squared < (one_g+raw_tolerance)*(one_g+raw_tolerance);
 }
 
 boolean hexbright::moved(double tolerance) {
-  return abs(new_magnitude-1)>tolerance;
+  return abs(acc_ctx.new_magnitude-1)>tolerance;
  }
 
+void hexbright::push_accel_sample(char* sample) {
+  // replace the oldest sample, updating the running sums as we go
+  char* slot = acc_ctx.acc_history[acc_ctx.acc_history_pos];
+  acc_ctx.acc_history_pos = (acc_ctx.acc_history_pos+1)%ACC_HISTORY;
+  for(int i=0; i<3; i++) {
+    char old_value = slot[i];
+    char value = sample[i];
+    slot[i] = value;
+    acc_ctx.acc_sum[i] += value - old_value;
+    acc_ctx.acc_sum_squares[i] += value*value - old_value*old_value;
+    // only rescan the window if we just dropped the current extreme
+    if(value >= acc_ctx.acc_max[i]) {
+      acc_ctx.acc_max[i] = value;
+    } else if(old_value == acc_ctx.acc_max[i]) {
+      acc_ctx.acc_max[i] = value;
+      for(int j=0; j<ACC_HISTORY; j++)
+        acc_ctx.acc_max[i] = max(acc_ctx.acc_max[i], acc_ctx.acc_history[j][i]);
+    }
+    if(value <= acc_ctx.acc_min[i]) {
+      acc_ctx.acc_min[i] = value;
+    } else if(old_value == acc_ctx.acc_min[i]) {
+      acc_ctx.acc_min[i] = value;
+      for(int j=0; j<ACC_HISTORY; j++)
+        acc_ctx.acc_min[i] = min(acc_ctx.acc_min[i], acc_ctx.acc_history[j][i]);
+    }
+  }
+}
+
+int hexbright::get_accel_mean(byte axis) {
+  return acc_ctx.acc_sum[axis]/ACC_HISTORY;
+}
+
+int hexbright::get_accel_variance(byte axis) {
+  // E[x^2]-E[x]^2, scaled to keep everything in integers
+  long sum = acc_ctx.acc_sum[axis];
+  return ((long)acc_ctx.acc_sum_squares[axis]*ACC_HISTORY - sum*sum)/(ACC_HISTORY*ACC_HISTORY);
+}
+
+char hexbright::get_accel_min(byte axis) {
+  return acc_ctx.acc_min[axis];
+}
+
+char hexbright::get_accel_max(byte axis) {
+  return acc_ctx.acc_max[axis];
+}
+
+char hexbright::get_accel_sample(byte age, byte axis) {
+  return acc_ctx.acc_history[(acc_ctx.acc_history_pos+ACC_HISTORY-1-age)%ACC_HISTORY][axis];
+}
+
+byte hexbright::get_accelerometer_events() {
+  byte events = acc_ctx.acc_events;
+  acc_ctx.acc_events = 0;
+  return events;
+}
+
+byte hexbright::get_facing() {
+  return acc_ctx.acc_tilt & 0x03;
+}
+
+byte hexbright::get_orientation() {
+  return (acc_ctx.acc_tilt >> 2) & 0x07;
+}
+
+byte hexbright::read_accelerometer_register(byte acc_reg) {
+  // this blocks, and throws away any background read that hasn't been collected
+  twi_finish();
+  acc_ctx.acc_read_start = ACC_NO_READ;
+  ctx.twi_buffer[0] = acc_reg;
+  twi_start(ACC_ADDRESS, 1, 1);
+  if(!twi_finish())
+    return 0x40; // looks like a bad read
+  return ctx.twi_buffer[0];
+}
+
+void hexbright::write_accelerometer(byte* data, byte count) {
+  twi_finish();
+  if(acc_ctx.acc_read_start != ACC_NO_READ) {
+    acc_ctx.acc_read_start = ACC_NO_READ;
+    acc_ctx.acc_interrupt = true;
+  }
+  for(int i=0; i<count; i++)
+    ctx.twi_buffer[i] = data[i];
+  twi_start(ACC_ADDRESS, count, 0);
+  twi_finish();
+}
+
+void hexbright::update_tilt(byte tilt) {
+#if (DEBUG==DEBUG_ACCEL)
+  log_event(EVENT_TILT, tilt);
+#endif
+  if(tilt & 0x20) // B001xxxxx, tap
+    acc_ctx.acc_events |= ACC_EVENT_TAP;
+  if(tilt & 0x80) // B1xxxxxxx, shake
+    acc_ctx.acc_events |= ACC_EVENT_SHAKE;
+  tilt &= 0x1F; // PoLa and BaFro
+  if(tilt != acc_ctx.acc_tilt) {
+    acc_ctx.acc_tilt = tilt;
+    acc_ctx.acc_events |= ACC_EVENT_ORIENTATION;
+  }
+}
+
+void hexbright::set_accelerometer_use(byte use) {
+  acc_ctx.acc_use = use;
+}
+
+void hexbright::update_accelerometer_mode() {
+  byte mode = acc_ctx.acc_use & (ACC_USE_MOTION | ACC_USE_EVENTS);
+  if(ctx.shut_down && !(acc_ctx.acc_use & ACC_USE_WHILE_OFF))
+    mode = 0;
+  if(mode == acc_ctx.acc_mode)
+    return;
+#if (DEBUG==DEBUG_ACCEL)
+  log_event(EVENT_ACC_MODE, mode);
+#endif
+  if(mode) {
+    // With only events in use, drop to the auto-wake rate after 
+    //  ACC_SLEEP_COUNT quiet samples; a shake or orientation change wakes it
+    //  back up to the full rate (datasheet page 11), but taps aren't detected
+    //  while it sleeps.  Never with motion in use: asleep, it would sample at
+    //  the auto-wake rate while we kept reading at the full one, filling the
+    //  history with repeats.
+    byte enable[] = {ACC_REG_MODE, (byte)((mode & ACC_USE_MOTION) ? 0x01 : 0x19)}; // active, or ASE, AWE, active
+    write_accelerometer(enable, sizeof(enable));
+    acc_ctx.acc_interrupt = true; // pick up the current orientation
+  } else {
+    disable_accelerometer();
+  }
+  acc_ctx.acc_mode = mode;
+}
+
 byte hexbright::read_accelerometer(byte acc_reg) {
   if (!digitalRead(DPIN_ACC_INT)) {
-    Wire.beginTransmission(ACC_ADDRESS);
-    Wire.write(acc_reg);
-    Wire.endTransmission(false);       // End, but do not stop!
-    Wire.requestFrom(ACC_ADDRESS, 1);  
-    return Wire.read();
+    return read_accelerometer_register(acc_reg);
   }
   return 0;
 }
 
 
+void hexbright::set_accelerometer_rate(byte rate, byte filter) {
+  acc_ctx.acc_rate = rate;
+  acc_ctx.acc_filter = filter;
+  enable_accelerometer(); // the new rate can only be written in standby
+}
+
+void hexbright::init_accelerometer_state() {
+  acc_ctx.new_vector = acc_ctx.vectors;
+  acc_ctx.old_vector = acc_ctx.vectors+3;
+  acc_ctx.light_axis[1] = -1;
+  acc_ctx.acc_interrupt = true;
+  acc_ctx.acc_read_start = ACC_NO_READ;
+  acc_ctx.acc_use = ACC_USE_MOTION | ACC_USE_EVENTS;
+  acc_ctx.acc_rate = ACC_RATE_AUTO;
+  acc_ctx.acc_filter = ACC_FILTER_NORMAL;
+  acc_ctx.gravity_filter_shift = 3;
+  acc_ctx.acc_debounce = 3;
+}
+
 void hexbright::enable_accelerometer() {
-  byte sample_rate = 6; //111
-  for(int i=0; i<=6; i++) {
-    if(1000/ms_delay> (1<<i)) {
-      //       1000/12000>1, leave sample_rate at 6
-      //       1000/200>1, sample_rate=5(110)
-      //       1000/200>2, sample_rate=4(101)
-      //       1000/200>4, sample_rate=3(100)
-      //       1000/200>8, sample_rate=3(011)
-      //       1000/200>16, sample_rate=3(010)
-      //       1000/200>32, sample_rate=3(001)
-      //       1000/200>64, sample_rate=3(111)
-      //       1000/200>128, sample_rate=3(111)
-      sample_rate = 6-i;
+  twi_init();
+  if(acc_ctx.acc_rate == ACC_RATE_AUTO) {
+    // roughly match the update rate
+    acc_ctx.acc_rate = ACC_RATE_2;
+    for(int i=0; i<=6; i++) {
+      if(1000/ctx.ms_delay> (1<<i)) {
+        //       ms_delay=250: 4>2, acc_rate=5 (4 samples/second)
+        //       ms_delay=20: 50>32, acc_rate=1 (64)
+        //       ms_delay=10: 100>64, acc_rate=0 (120)
+        acc_ctx.acc_rate = 6-i;
+      }
     }
   }
+  // Keep the gravity filter's time constant near 65 ms (8 samples at 120 
+  //  samples/second, 1 at 16), and the orientation debounce in step with it.
+  char shift = 3-acc_ctx.acc_rate;
+  if(acc_ctx.acc_filter == ACC_FILTER_FAST)
+    shift--;
+  else if(acc_ctx.acc_filter == ACC_FILTER_SMOOTH)
+    shift += 2;
+  acc_ctx.gravity_filter_shift = max(shift, 0);
+  acc_ctx.acc_debounce = min(acc_ctx.gravity_filter_shift, 7);
 #if (DEBUG==DEBUG_ACCEL)
-  Serial.println((int)sample_rate);
+  log_event(EVENT_ACC_RATE, acc_ctx.acc_rate);
 #endif
 
-  
-  // Configure accelerometer
+  // Configure accelerometer (registers can only be written in standby)
   byte config[] = {
-    ACC_REG_INTS,  // First register (see next line)
-    0xE4,  // Interrupts: shakes, taps
-    0x00,  // Mode: not enabled yet
-    sample_rate,  // Sample rate: 120 Hz (see datasheet page 19)
+    ACC_REG_SPCNT,  // First register (see next line)
+    ACC_SLEEP_COUNT,  // Samples without activity before auto-sleep
+    0xE7,  // Interrupts: shakes, taps, portrait/landscape, front/back
+    0x00,  // Mode: standby
+    (byte)((acc_ctx.acc_debounce<<5) | acc_ctx.acc_rate),  // Sample rate (see datasheet page 19), auto-wake at 32 Hz, orientation debounce
     0x0F,  // Tap threshold
     0x05   // Tap debounce samples
   };
-  Wire.beginTransmission(ACC_ADDRESS);
-  Wire.write(config, sizeof(config));
-  Wire.endTransmission();
-
-  // Enable accelerometer
-  byte enable[] = {ACC_REG_MODE, 0x01};  // Mode: active!
-  Wire.beginTransmission(ACC_ADDRESS);
-  Wire.write(enable, sizeof(enable));
-  Wire.endTransmission();
+  write_accelerometer(config, sizeof(config));
+  acc_ctx.acc_mode = 0;
  
- // pinMode(DPIN_ACC_INT,  INPUT);
- // digitalWrite(DPIN_ACC_INT,  HIGH);
+  // the interrupt line is open drain, active low (datasheet page 17)
+  pinMode(DPIN_ACC_INT,  INPUT);
+  digitalWrite(DPIN_ACC_INT,  HIGH);
+  attachInterrupt(1, accelerometer_interrupt, FALLING); // interrupt 1 = digital pin 3
+
+  // Enable accelerometer, if the sketch wants it
+  update_accelerometer_mode();
 }
 
 void hexbright::disable_accelerometer() {
-  
+  // standby: no sampling, a couple of uA, registers are kept
+  byte standby[] = {ACC_REG_MODE, 0x00};
+  write_accelerometer(standby, sizeof(standby));
+  acc_ctx.acc_mode = 0;
 }
 
 #endif
@@ -697,55 +1599,55 @@ void hexbright::disable_accelerometer() {
 //////////////////UTILITIES////////////////////
 ///////////////////////////////////////////////
 
-long _number = 0;
-byte _color = GLED;
-int print_wait_time = 0;
-
 #if (defined(LED) && defined(PRINT_NUMBER))
+void hexbright::init_number_state() {
+  number_ctx._color = GLED;
+  number_ctx.number_gap_ticks = 2500/ctx.ms_delay;
+  number_ctx.flash_gap_ticks = 300/ctx.ms_delay;
+  number_ctx.digit_gap_ticks = 600/ctx.ms_delay;
+  number_ctx.zero_flash_ticks = 400/ctx.ms_delay;
+  number_ctx.flash_ticks = 120/ctx.ms_delay;
+  number_ctx.negative_flash_ticks = 500/ctx.ms_delay;
+  number_ctx.led_wait_ticks = 100/ctx.ms_delay;
+}
+
 boolean hexbright::printing_number() {
-  return _number || print_wait_time; 
+  return number_ctx._number || number_ctx.print_wait_time; 
 }
 
 void hexbright::update_number() {
-  if(_number>0) { // we have something to do...
-#ifdef DEBUG
-    if(DEBUG==DEBUG_NUMBER) {
-      static int last_printed = 0;
-      if(last_printed != _number) {
-        last_printed = _number;
-        Serial.print("number remaining (read from right to left): ");
-        Serial.println(_number);
-      }
+  if(number_ctx._number>0) { // we have something to do...
+#if (DEBUG==DEBUG_NUMBER)
+    if(ctx.last_logged != number_ctx._number) {
+      ctx.last_logged = number_ctx._number;
+      log_event(EVENT_NUMBER, number_ctx._number);
     }
 #endif
-    if(!print_wait_time) {
-      if(_number==1) { // minimum delay between printing numbers
-        print_wait_time = 2500/ms_delay;
-        _number = 0;
+    if(!number_ctx.print_wait_time) {
+      if(number_ctx._number==1) { // minimum delay between printing numbers
+        number_ctx.print_wait_time = number_ctx.number_gap_ticks;
+        number_ctx._number = 0;
         return;
       } else {
-        print_wait_time = 300/ms_delay; 
+        number_ctx.print_wait_time = number_ctx.flash_gap_ticks; 
       }
-      if(_number/10*10==_number) {
-#if (DEBUG==DEBUG_NUMBER)
-        Serial.println("zero"); 
-#endif
+      if(number_ctx._number/10*10==number_ctx._number) {
 //        print_wait_time = 500/ms_delay; 
-        set_led(_color, 400); 
+        set_led_ticks(number_ctx._color, number_ctx.zero_flash_ticks, number_ctx.led_wait_ticks); 
       } else {
-        set_led(_color, 120);
-        _number--;
+        set_led_ticks(number_ctx._color, number_ctx.flash_ticks, number_ctx.led_wait_ticks);
+        number_ctx._number--;
       }
-      if(_number && !(_number%10)) { // next digit?
-        print_wait_time = 600/ms_delay;
-        _color = flip_color(_color);
-        _number = _number/10;
+      if(number_ctx._number && !(number_ctx._number%10)) { // next digit?
+        number_ctx.print_wait_time = number_ctx.digit_gap_ticks;
+        number_ctx._color = flip_color(number_ctx._color);
+        number_ctx._number = number_ctx._number/10;
       }
     }
   } 
 
-  if(print_wait_time) {
-    print_wait_time--;
+  if(number_ctx.print_wait_time) {
+    number_ctx.print_wait_time--;
   } 
 }
 
@@ -761,52 +1663,225 @@ void hexbright::print_number(long number) {
     number = 0-number;
     negative = true; 
   }
-  _color = GLED;
-  _number=1; // to guarantee printing when dealing with trailing zeros (100 can't be stored as 001, use 1001)
+  number_ctx._color = GLED;
+  number_ctx._number=1; // to guarantee printing when dealing with trailing zeros (100 can't be stored as 001, use 1001)
   while(number>0) {
-    _number = _number * 10 + (number%10); 
+    number_ctx._number = number_ctx._number * 10 + (number%10); 
     number = number/10;
-    _color = flip_color(_color);
+    number_ctx._color = flip_color(number_ctx._color);
   }
   if(negative) {
-    set_led(flip_color(_color), 500);
-    print_wait_time = 600/ms_delay;
+    set_led_ticks(flip_color(number_ctx._color), number_ctx.negative_flash_ticks, number_ctx.led_wait_ticks);
+    number_ctx.print_wait_time = number_ctx.digit_gap_ticks;
+  }
+}
+#endif
+
+///////////////////////////////////////////////
+//////////////////////ADC//////////////////////
+///////////////////////////////////////////////
+
+// analogRead waits about .2 ms for each conversion.  Instead, each update 
+//  starts a round of conversions which run in the background (one after 
+//  another, from the ADC interrupt) while the rest of the update runs.  
+//  The results are picked up at the start of the next update.
+// Don't use analogRead in your sketch, it will fight with this.
+
+// the order conversions are done in each update; the thermal sensor is 
+//  oversampled, see THERMAL_EXTRA_BITS.  The first conversion after switching
+//  to the bandgap is thrown away, it hasn't settled yet (data sheet 23.5.2).
+#define ADC_CHARGE THERMAL_SAMPLES
+#define ADC_VCC (THERMAL_SAMPLES+2)
+#define ADC_BANDGAP 0x0E // mux setting for the internal 1.1V reference
+
+byte adc_pin(byte index) {
+  if(index < THERMAL_SAMPLES)
+    return APIN_TEMP;
+  if(index == ADC_CHARGE)
+    return APIN_CHARGE;
+  return ADC_BANDGAP;
+}
+
+ISR(ADC_vect) {
+  if(ctx.adc_index >= ADC_CONVERSIONS) // an analogRead, not ours
+    return;
+  ctx.adc_values[ctx.adc_index] = ADC;
+  if(++ctx.adc_index < ADC_CONVERSIONS) {
+    ADMUX = (DEFAULT<<6) | adc_pin(ctx.adc_index); // reference as analogRead uses
+    ctx.adc_start_tcnt = TCNT0;
+    ADCSRA |= _BV(ADSC);
+  } else {
+    ADCSRA &= ~_BV(ADIE);
   }
 }
+
+// While the light is off, sleep through conversions in ADC noise reduction 
+//  mode (ATmega168 data sheet, section 23.7).  That stops clkIO: the timers,
+//  and with them the light's and leds' pwm and millis, the twi clock, and 
+//  the usart, so only do it when none of those matter.
+// Timer0 misses what's left of the conversion when we go to sleep (up to 
+//  .2 ms each, 1.4 ms an update), so millis is put forward by that much when
+//  we wake.  That's measured in timer0's 8 us ticks from the conversion's 
+//  start (which waits for the next adc clock), so each correction can be 
+//  off by a couple of ticks, rather than the whole conversion.  micros 
+//  doesn't get the correction.
+void hexbright::adc_sleep() {
+  if(ctx.light_on)
+    return;
+#ifdef LED
+  if(ctx.led_on_time[GLED]>=0 || ctx.led_on_time[RLED]>=0)
+    return;
+#endif
+#ifdef ACCELEROMETER
+  if(twi_busy())
+    return;
 #endif
+  if(UCSR0B & _BV(TXEN0)) // Serial.begin (or telemetry) was called, a byte may be going out
+    return;
+  cli();
+  if(ctx.adc_index < ADC_CONVERSIONS) { // a conversion is running, and will wake us
+    byte ticks = TCNT0 - ctx.adc_start_tcnt; // timer0 counts every 64 cycles
+    int slept_us = ADC_CONVERSION_US - ticks*(64/(F_CPU/1000000));
+    set_sleep_mode(SLEEP_MODE_ADC);
+    sleep_enable();
+    sei(); // the instruction after sei always runs, so we can't miss the wakeup
+    sleep_cpu();
+    sleep_disable();
+    cli();
+    if(slept_us > 0) {
+      ctx.adc_slept_us += slept_us;
+      timer0_millis += ctx.adc_slept_us/1000;
+      ctx.adc_slept_us %= 1000;
+    }
+  }
+  sei();
+}
+
+boolean hexbright::read_adc() {
+  if(ctx.adc_index < ADC_CONVERSIONS) // still converting (very short update_delay_ms), try again next time
+    return false;
+  // the first call only starts a round; there's nothing to read yet
+  boolean finished = ctx.adc_index == ADC_CONVERSIONS;
+  // the round is finished, so the interrupt won't touch these
+  unsigned int round_sum = 0;
+  for(int i=0; i<THERMAL_SAMPLES; i++)
+    round_sum += ctx.adc_values[i];
+  int charge_reading = ctx.adc_values[ADC_CHARGE];
+  int vcc_reading = ctx.adc_values[ADC_VCC];
+
+  ctx.adc_index = 0;
+  ADMUX = (DEFAULT<<6) | adc_pin(0);
+  ctx.adc_start_tcnt = TCNT0;
+  ADCSRA |= _BV(ADIF) | _BV(ADIE) | _BV(ADSC); // writing ADIF clears any old result
+
+  if(!finished)
+    return false;
+  ctx.charge_value = charge_reading;
+  filter_thermal(round_sum);
+  track_charge(ctx.charge_value);
+  filter_vcc(vcc_reading);
+  return true;
+}
+
+void hexbright::filter_thermal(unsigned int round_sum) {
+  if(!ctx.thermal_filter) {
+    // first reading, start the filter here instead of at 0
+    ctx.thermal_filter = ((unsigned long)round_sum<<THERMAL_EXTRA_BITS)/THERMAL_SAMPLES;
+    ctx.thermal_filter <<= THERMAL_FILTER_SHIFT;
+  } 
+  ctx.thermal_sum += round_sum;
+  ctx.thermal_count += THERMAL_SAMPLES;
+  if(ctx.thermal_count >= (1<<(2*THERMAL_EXTRA_BITS))) {
+    // 4^n samples, divided by 2^n, gives n more bits
+    int fine = ctx.thermal_sum >> THERMAL_EXTRA_BITS;
+    ctx.thermal_sum = 0;
+    ctx.thermal_count = 0;
+    ctx.thermal_filter += fine - (ctx.thermal_filter >> THERMAL_FILTER_SHIFT);
+  }
+  // rounded back to 10 bits
+  ctx.thermal_sensor_value = (get_thermal_sensor_fine() + (1<<THERMAL_EXTRA_BITS>>1)) >> THERMAL_EXTRA_BITS;
+}
+
+void hexbright::filter_vcc(int reading) {
+  if(!reading) // not a real reading
+    return;
+  if(!ctx.vcc_filter)
+    ctx.vcc_filter = reading<<VCC_FILTER_SHIFT;
+  else
+    ctx.vcc_filter += reading - (ctx.vcc_filter >> VCC_FILTER_SHIFT);
+}
 
 ///////////////////////////////////////////////
 ////////////////TEMPERATURE////////////////////
 ///////////////////////////////////////////////
 
-int thermal_sensor_value = 0;
-void hexbright::read_thermal_sensor() {
-  // do not call this directly.  Call get_temperature()
-  // read temperature setting
-  // device data sheet: http://ww1.microchip.com/downloads/en/devicedoc/21942a.pdf
-  
-  thermal_sensor_value = analogRead(APIN_TEMP);
+// device data sheet: http://ww1.microchip.com/downloads/en/devicedoc/21942a.pdf
+
+// saved calibration, as laid out at THERMAL_CALIBRATION_ADDRESS.  Packed, 
+//  with 16 bit readings, so the host (tools/replay) lays it out as the avr does.
+struct thermal_calibration {
+  byte magic;
+  uint16_t zero; // readings with 3 fractional bits
+  uint16_t hot;
+  byte hot_celsius;
+} __attribute__((packed));
+// (no static_assert in the avr's c++98) fails to compile if it doesn't fit
+typedef char thermal_calibration_fits[sizeof(thermal_calibration)==E2END+1-THERMAL_CALIBRATION_ADDRESS ? 1 : -1];
+
+void hexbright::load_thermal_calibration() {
+  thermal_calibration saved;
+  eeprom_read_block(&saved, (const void*)THERMAL_CALIBRATION_ADDRESS, sizeof(saved));
+  if(saved.magic==THERMAL_CALIBRATION_MAGIC && saved.hot>saved.zero && saved.hot_celsius) {
+    apply_thermal_calibration(saved.zero>>(3-THERMAL_EXTRA_BITS),
+                              saved.hot>>(3-THERMAL_EXTRA_BITS),
+                              saved.hot_celsius);
+  } else {
+    apply_thermal_calibration(THERMAL_DEFAULT_ZERO, THERMAL_DEFAULT_HOT, THERMAL_DEFAULT_HOT_CELSIUS);
+  }
+}
+
+void hexbright::apply_thermal_calibration(int zero, int hot, byte hot_celsius) {
+  int span = hot-zero;
+  ctx.thermal_zero = zero;
+  ctx.celsius_scale = ((long)hot_celsius<<16)/span;
+  ctx.fahrenheit_scale = ((long)hot_celsius*9<<16)/(5L*span);
+  // OVERHEAT_CELSIUS as a (rounded) get_thermal_sensor() reading
+  long overheat = zero + ((long)OVERHEAT_CELSIUS*span + hot_celsius/2)/hot_celsius;
+  ctx.overheat_temperature = (overheat + (1<<THERMAL_EXTRA_BITS>>1)) >> THERMAL_EXTRA_BITS;
+#if (DEBUG==DEBUG_TEMP)
+  log_event(EVENT_THERMAL_ZERO, zero);
+  log_event(EVENT_THERMAL_HOT, hot);
+#endif
+}
+
+boolean hexbright::set_thermal_calibration(int zero, int hot, byte hot_celsius) {
+  if(hot<=zero || !hot_celsius)
+    return false;
+  thermal_calibration saved;
+  saved.magic = THERMAL_CALIBRATION_MAGIC;
+  saved.zero = zero<<(3-THERMAL_EXTRA_BITS);
+  saved.hot = hot<<(3-THERMAL_EXTRA_BITS);
+  saved.hot_celsius = hot_celsius;
+  eeprom_write_block(&saved, (void*)THERMAL_CALIBRATION_ADDRESS, sizeof(saved));
+  apply_thermal_calibration(zero, hot, hot_celsius);
+  return true;
 }
 
 int hexbright::get_celsius() {
-  // 0C ice water bath for 20 minutes: 153.
-  // 40C water bath for 20 minutes (measured by medical thermometer): 275
-  // intersection with 0: 50 = (40C-0C)/(275-153)*153
-  
-  // 40.05 is to force the division to floating point.  The extra parenthesis are to 
-  //  tell the compiler to pre-evaluate the expression.
-  return thermal_sensor_value * ((40.05-0)/(275-153)) - 50; 
+  // add .5 before the shift to round instead of floor
+  return ((get_thermal_sensor_fine()-ctx.thermal_zero)*ctx.celsius_scale + 0x8000) >> 16;
 }
 
 int hexbright::get_fahrenheit() {
-  //return get_celsius()*18/10+32;
-  // algebraic form of (get_celsius' formula)*18/10+32
-  // I was lazy and pasted (x*((40.05-0)/(275-153)) - 50)*18/10+32 into wolfram alpha
-  return .590902*thermal_sensor_value-58;
+  return (((get_thermal_sensor_fine()-ctx.thermal_zero)*ctx.fahrenheit_scale + 0x8000) >> 16) + 32;
 }
 
 int hexbright::get_thermal_sensor() {
-  return thermal_sensor_value;
+  return ctx.thermal_sensor_value;
+}
+
+int hexbright::get_thermal_sensor_fine() {
+  return ctx.thermal_filter >> THERMAL_FILTER_SHIFT;
 }
 
 
@@ -815,35 +1890,171 @@ int hexbright::get_thermal_sensor() {
 //////////////////CHARGING/////////////////////
 ///////////////////////////////////////////////
 
-byte hexbright::get_charge_state() {
-  int charge_value = analogRead(APIN_CHARGE);
+void hexbright::track_charge(int value) {
+  // leaving a state takes CHARGE_HYSTERESIS more than entering it
+  int low = CHARGE_LOW;
+  int high = CHARGE_HIGH;
+  if(ctx.charge_reading==CHARGING)
+    low += CHARGE_HYSTERESIS;
+  else if(ctx.charge_reading==CHARGED)
+    high -= CHARGE_HYSTERESIS;
+  if(value<low)
+    ctx.charge_reading = CHARGING;
+  else if(value>high)
+    ctx.charge_reading = CHARGED;
+  else
+    ctx.charge_reading = BATTERY;
+
+  if(!ctx.charge_stable) { // first reading (init_hardware), nothing to debounce against
+    ctx.charge_stable = ctx.charge_reading;
+    return;
+  }
+  if(ctx.charge_reading==ctx.charge_stable) {
+    ctx.charge_pending_ms = 0;
+    return;
+  }
+  ctx.charge_pending_ms += ctx.ms_delay;
+  if(ctx.charge_pending_ms < CHARGE_DEBOUNCE_MS)
+    return;
+
+  if(ctx.charge_stable==BATTERY)
+    ctx.charge_events |= CHARGE_EVENT_PLUGGED;
+  else if(ctx.charge_reading==BATTERY)
+    ctx.charge_events |= CHARGE_EVENT_UNPLUGGED;
+  else if(ctx.charge_reading==CHARGED)
+    ctx.charge_events |= CHARGE_EVENT_COMPLETE;
 #if (DEBUG==DEBUG_CHARGE)
-  Serial.print("Current charge reading: ");
-  Serial.println(charge_value);
-#endif
-  // <128 charging, >768 charged, battery
-  if(charge_value<128)
-    return CHARGING;
-  else if (charge_value>768)
-    return CHARGED;
-  return BATTERY;
-}
-
-// reading twice costs us 28 bytes, but improves reliability.
-// The root problem is when the charge value goes from <128 to >768 (or the 
-//  reverse, from topping off), it passes through the middle range.  If we 
-//  read at the wrong time, we can get a BATTERY value while we are still 
-//  plugged in.
-// Reading twice with a sufficient delay, we can guarantee that our state is correct.
+  log_event(EVENT_CHARGE, ctx.charge_reading<<12 | value);
+#endif
+  ctx.charge_stable = ctx.charge_reading;
+  ctx.charge_pending_ms = 0;
+}
+
+byte hexbright::get_charge_state() {
+  return ctx.charge_reading;
+}
+
 byte hexbright::get_definite_charge_state() {
-  byte val1 = get_charge_state();
-  // do something that will take some time...
-  // delayMicroseconds costs an extra 20 bytes (because nowhere else is it called)
-  // If other code needs delayMicroseconds, switch to it.
-  //delayMicroseconds(30); 
-  read_thermal_sensor(); // delay a little...
-  byte val2 = get_charge_state();
-  // BATTERY & CHARGING = CHARGING, BATTERY & CHARGED = CHARGED, CHARGED & CHARGING = CHARGING
-  // In essence, only return the middle value (BATTERY) if two reads report the same thing.
-  return val1 & val2;
-}
\ No newline at end of file
+  return ctx.charge_stable;
+}
+
+byte hexbright::get_charge_events() {
+  byte events = ctx.charge_events;
+  ctx.charge_events = 0;
+  return events;
+}
+
+
+
+///////////////////////////////////////////////
+//////////////////BATTERY//////////////////////
+///////////////////////////////////////////////
+
+// The bandgap reading is 1024*VCC_BANDGAP_MV/vcc, so vcc is 
+//  1024*VCC_BANDGAP_MV/reading.  The avr runs off the cell through the power 
+//  switch, so its supply is the battery voltage.
+
+int hexbright::battery_load_ma() {
+  if(!ctx.light_on)
+    return 0;
+  return driver_ma(ctx.driver_mode, ctx.driver_pwm);
+}
+
+int hexbright::get_battery_mv() {
+  if(!ctx.vcc_filter)
+    return 0;
+  int mv = ((1024L*VCC_BANDGAP_MV)<<VCC_FILTER_SHIFT)/ctx.vcc_filter;
+  mv += (long)battery_load_ma()*BATTERY_RESISTANCE_MOHM/1000;
+#if (DEBUG==DEBUG_BATTERY)
+  if(abs(ctx.logged_mv-mv)>10) {
+    ctx.logged_mv = mv;
+    log_event(EVENT_BATTERY_MV, mv);
+  }
+#endif
+  return mv;
+}
+
+// resting voltage of a typical lithium ion cell, every 10%, 0% first
+const int battery_curve[] PROGMEM = {3300, 3500, 3600, 3650, 3700, 3750, 3800, 3870, 3950, 4050, 4150};
+
+byte hexbright::get_battery_percent() {
+  int mv = get_battery_mv();
+  if(mv<=(int)pgm_read_word(&battery_curve[0]))
+    return 0;
+  for(byte i=1; i<=10; i++) {
+    int high = pgm_read_word(&battery_curve[i]);
+    if(mv<high) {
+      int low = pgm_read_word(&battery_curve[i-1]);
+      return (i-1)*10 + (mv-low)*10/(high-low);
+    }
+  }
+  return 100;
+}
+
+
+///////////////////////////////////////////////
+//////////////////TELEMETRY////////////////////
+///////////////////////////////////////////////
+
+#ifdef TELEMETRY
+// The usart is driven directly (not through Serial, which would block 
+//  once its buffer filled).  ATmega168 data sheet, chapter 19.
+#define TELEMETRY_SLOT(i) ((i) & (TELEMETRY_BUFFER-1))
+
+void hexbright::init_telemetry() {
+  UCSR0A = _BV(U2X0); // double speed, for less baud rate error
+  UBRR0 = (F_CPU/4/TELEMETRY_BAUD-1)/2;
+  UCSR0C = _BV(UCSZ01) | _BV(UCSZ00); // 8N1
+  UCSR0B = _BV(TXEN0);
+}
+
+void hexbright::send_telemetry() {
+  byte free_bytes = TELEMETRY_BUFFER-1 - TELEMETRY_SLOT(ctx.telemetry_head-ctx.telemetry_tail);
+  unsigned int tick = ctx.telemetry_tick++;
+  if(free_bytes < TELEMETRY_RECORD_BYTES) {
+    if(ctx.telemetry_dropped<255)
+      ctx.telemetry_dropped++;
+    return;
+  }
+
+  int temperature = get_thermal_sensor();
+  int level = get_light_level();
+  byte record[TELEMETRY_RECORD_BYTES] = {
+    0xA5, 0x5A,
+    lowByte(tick), highByte(tick),
+#ifdef ACCELEROMETER
+    (byte)acc_ctx.acc_raw[0], (byte)acc_ctx.acc_raw[1], (byte)acc_ctx.acc_raw[2],
+#else
+    0, 0, 0,
+#endif
+    lowByte(temperature), highByte(temperature),
+    lowByte(level), highByte(level),
+    lowByte(ctx.safe_light_level), highByte(ctx.safe_light_level),
+    !ctx.released,
+    ctx.telemetry_dropped,
+    0};
+  ctx.telemetry_dropped = 0;
+
+  byte head = ctx.telemetry_head;
+  byte sum = 0;
+  for(byte i=0; i<TELEMETRY_RECORD_BYTES; i++) {
+    if(i>=2 && i<TELEMETRY_RECORD_BYTES-1)
+      sum += record[i];
+    ctx.telemetry_buffer[head] = i<TELEMETRY_RECORD_BYTES-1 ? record[i] : sum;
+    head = TELEMETRY_SLOT(head+1);
+  }
+  ctx.telemetry_head = head;
+  // the interrupt turns itself off when the buffer empties
+  UCSR0B |= _BV(UDRIE0);
+}
+
+ISR(USART_UDRE_vect) {
+  byte tail = ctx.telemetry_tail;
+  if(tail == ctx.telemetry_head) {
+    UCSR0B &= ~_BV(UDRIE0);
+    return;
+  }
+  UDR0 = ctx.telemetry_buffer[tail];
+  ctx.telemetry_tail = TELEMETRY_SLOT(tail+1);
+}
+#endif
@@ -27,15 +27,34 @@ of the authors and should not be interpreted as representing official policies,
 either expressed or implied, of the FreeBSD Project.
 */
 
-#include <Wire.h>
+#ifndef HEXBRIGHT_H
+#define HEXBRIGHT_H
+
 #include <Arduino.h>
 
 /// Some space-saving options
+// These are compiled into the library for every sketch.  To leave one out 
+//  of a single sketch, use hexbright_fixed with FEATURE_* flags (below) instead.
+// (tools/bench builds with -DHEXBRIGHT_NO_LED and so on to compare them)
+#ifndef HEXBRIGHT_NO_LED
 #define LED // comment out save 786 bytes if you don't use the rear LEDs
+#endif
+#ifndef HEXBRIGHT_NO_PRINT_NUMBER
 #define PRINT_NUMBER // comment out to save 626 bytes if you don't need to print numbers (but need the LEDs)
+#endif
+#ifndef HEXBRIGHT_NO_ACCELEROMETER
 #define ACCELEROMETER //comment out to save 3500 bytes (in development, it will shrink a lot once it's finished)
+#endif
+
+// hexbright_fixed features.  Overheat and low battery protection always run.
+#define FEATURE_LED 1
+#define FEATURE_PRINT_NUMBER 2 // needs FEATURE_LED
+#define FEATURE_ACCELEROMETER 4
+#define FEATURE_ALL (FEATURE_LED | FEATURE_PRINT_NUMBER | FEATURE_ACCELEROMETER)
 
 // In development, api will change.
+// The accelerometer is read with the library's own interrupt driven i2c 
+//  (in the background, between updates).  Don't include Wire.h in your sketch.
 #ifdef ACCELEROMETER 
 //#define DEBUG 6
 #define DPIN_ACC_INT 3
@@ -45,8 +64,65 @@ either expressed or implied, of the FreeBSD Project.
 #define ACC_REG_YOUT            1
 #define ACC_REG_ZOUT            2
 #define ACC_REG_TILT            3
+#define ACC_REG_SPCNT           5
 #define ACC_REG_INTS            6
 #define ACC_REG_MODE            7
+#define ACC_REG_SR              8
+
+// times to re-read a register that was being updated as we read it
+#define ACC_READ_RETRIES 3
+
+// quiet samples before the accelerometer drops to its auto-wake sample rate
+//  (about 2 seconds at 120 samples/second).  Only while just ACC_USE_EVENTS
+//  is in use; motion readings keep it at the full rate.
+#define ACC_SLEEP_COUNT 240
+
+// what the sketch needs from the accelerometer, see set_accelerometer_use()
+#define ACC_USE_MOTION    1 // readings every update (get_dp, stationary, match_gesture...)
+#define ACC_USE_EVENTS    2 // taps, shakes and orientation (get_accelerometer_events)
+#define ACC_USE_WHILE_OFF 4 // keep running after shutdown(), until set_light or the button is pressed or let go
+
+// number of samples kept for the windowed statistics.  Must be a power of 2.
+//  Each sample costs 3 bytes of ram.
+#define ACC_HISTORY 16
+
+// samples in a gesture template (see match_gesture).  Must be <= ACC_HISTORY.
+#define GESTURE_LENGTH 16
+// how far (in samples) a gesture may be stretched or squeezed in time when matching
+#define GESTURE_BAND 2
+
+// accelerometer sample rates (samples/second), see set_accelerometer_rate()
+#define ACC_RATE_120 0
+#define ACC_RATE_64  1
+#define ACC_RATE_32  2
+#define ACC_RATE_16  3
+#define ACC_RATE_8   4
+#define ACC_RATE_4   5
+#define ACC_RATE_2   6
+#define ACC_RATE_1   7
+
+// how heavily the down vector and orientation are filtered
+#define ACC_FILTER_FAST   0 // follows quickly, but noisier
+#define ACC_FILTER_NORMAL 1
+#define ACC_FILTER_SMOOTH 2 // steady, but lags
+
+// events detected by the accelerometer, see get_accelerometer_events()
+#define ACC_EVENT_TAP          1
+#define ACC_EVENT_SHAKE        2
+#define ACC_EVENT_ORIENTATION  4 // get_facing() or get_orientation() changed
+
+// get_facing() values (datasheet page 15, BaFro)
+#define ACC_FRONT 1
+#define ACC_BACK  2
+// get_orientation() values (datasheet page 15, PoLa)
+#define ACC_LEFT  1
+#define ACC_RIGHT 2
+#define ACC_DOWN  5
+#define ACC_UP    6
+
+// A recorded motion, oldest sample first, in raw readings with gravity 
+//  removed.  Store these in PROGMEM; tools/gesture_template.py builds them.
+typedef char gesture[GESTURE_LENGTH][3];
 #endif
 
 
@@ -63,15 +139,136 @@ either expressed or implied, of the FreeBSD Project.
 #define DEBUG_ACCEL 7 // accelerometer
 #define DEBUG_NUMBER 8 // number printing utility
 #define DEBUG_CHARGE 9 // charge state
+#define DEBUG_BATTERY 10 // battery voltage
+
+// Debug output from inside update() is logged as small binary events 
+//  (id, update tick, 16 bit value) in a RAM ring of DEBUG_EVENT_SLOTS, 
+//  instead of printed as text, which took milliseconds and changed the 
+//  timing being debugged.  Each update sends as many whole events as the 
+//  serial port can carry in update_delay_ms; if the ring fills up, new 
+//  events are dropped and counted (EVENT_DROPPED).  Frames are 0xA5, id, 
+//  tick, value (low byte first), and a checksum (the sum of the bytes after
+//  the 0xA5), mixed in with any text.  Decode them with tools/debug_log.py,
+//  which reads the names below from this file.
+#define DEBUG_BAUD 9600
+#define DEBUG_EVENT_SLOTS 16 // a power of 2, 4 bytes each
+
+// event ids
+#define EVENT_LOOP_TIME 1      // average update time, in .1 ms (each second in DEBUG_LOOP, or when updates run late)
+#define EVENT_LIGHT_REQUEST 2  // set_light start level (DEBUG_LIGHT)
+#define EVENT_LIGHT_LEVEL 3    // level sent to the driver (DEBUG_LIGHT)
+#define EVENT_DRIVER 4         // driver mode<<8 | pwm (DEBUG_LIGHT)
+#define EVENT_TEMPERATURE 5    // thermal sensor reading, when it changes (DEBUG_TEMP)
+#define EVENT_SAFE_LEVEL 6     // overheat protection's limit, while limiting
+#define EVENT_BATTERY_LEVEL 7  // low battery protection's limit, when it changes (DEBUG_BATTERY)
+#define EVENT_BATTERY_MV 8     // battery millivolts, when it changes (DEBUG_BATTERY)
+#define EVENT_SET_LED 9        // led<<8 | on time in updates (DEBUG_LED)
+#define EVENT_GLED 10          // green countdown, ms: on time, or negative wait time (DEBUG_LED)
+#define EVENT_RLED 11          // red countdown, ms: on time, or negative wait time (DEBUG_LED)
+#define EVENT_BUTTON_PRESS 12  // (DEBUG_BUTTON)
+#define EVENT_BUTTON_RELEASE 13 // ms held (DEBUG_BUTTON)
+#define EVENT_NUMBER 14        // low 16 bits of the number left to print (DEBUG_NUMBER)
+#define EVENT_CHARGE 15        // new charge state<<12 | charge reading (DEBUG_CHARGE)
+#define EVENT_TILT 16          // accelerometer tilt register (DEBUG_ACCEL)
+#define EVENT_GESTURE 17       // template<<8 | distance in percent (DEBUG_ACCEL)
+#define EVENT_DROPPED 18       // events lost because the ring was full
+#define EVENT_JAB_AXIS 19      // jab_detect, a big enough change: new<<8 | old alignment with the light, percent (DEBUG_ACCEL)
+#define EVENT_JAB 20           // jab_detect's result, when it finds one (DEBUG_ACCEL)
+#define EVENT_ACC_MODE 21      // ACC_USE_MOTION/EVENTS in effect, when it changes (DEBUG_ACCEL)
+#define EVENT_ACC_RATE 22      // ACC_RATE_* set by enable_accelerometer (DEBUG_ACCEL)
+#define EVENT_THERMAL_ZERO 23  // thermal calibration's 0C reading (DEBUG_TEMP)
+#define EVENT_THERMAL_HOT 24   // thermal calibration's reading at its hot point (DEBUG_TEMP)
+#define EVENT_USER 128         // first id for your own events (log_event)
+
+// Telemetry streams a record of the light's state every update, for 
+//  plotting or logging (tools/telemetry.py writes it out as csv).  It has 
+//  its own interrupt driven transmit buffer, so it never waits in update(); 
+//  a record that doesn't fit is dropped, and the drop counted in the next 
+//  one that does.  Records are TELEMETRY_RECORD_BYTES: 0xA5 0x5A, update 
+//  count (16 bits), accelerometer x, y, z (raw), thermal sensor, light 
+//  level, safe light level (16 bits each), button (1 = down), records 
+//  dropped since the last one, and a checksum (the sum of the bytes after 
+//  the 0xA5 0x5A).  16 bit values are low byte first.
+// It takes over the serial port: DEBUG must be off, and your sketch can't 
+//  use Serial.  Uncomment, or build with -DTELEMETRY.
+//#define TELEMETRY
+#define TELEMETRY_BAUD 38400 // 250000 is also exact at 8 MHz, if your reader can set it
+#define TELEMETRY_BUFFER 64 // bytes, a power of 2
+#define TELEMETRY_RECORD_BYTES 16
+
+#if (defined(TELEMETRY) && DEBUG!=DEBUG_OFF)
+#error TELEMETRY and DEBUG both use the serial port, turn one of them off
+#endif
 
 
 
+// Thermal sensor filtering.  Each update converts the sensor THERMAL_SAMPLES
+//  times; 4^THERMAL_EXTRA_BITS of those are summed and decimated into one 
+//  reading with THERMAL_EXTRA_BITS more resolution (10+THERMAL_EXTRA_BITS bits).
+//  That is then low-pass filtered, each reading moving the result
+//  1/(2^THERMAL_FILTER_SHIFT) of the way, for a time constant of about 
+//  2^THERMAL_FILTER_SHIFT * 4^THERMAL_EXTRA_BITS / THERMAL_SAMPLES updates
+//  (16 by default, .16 s at 10 ms updates).
+// THERMAL_EXTRA_BITS can be at most 3, and THERMAL_EXTRA_BITS+THERMAL_FILTER_SHIFT at most 6.
+#define THERMAL_SAMPLES 4
+#define THERMAL_EXTRA_BITS 2
+#define THERMAL_FILTER_SHIFT 2
+
+// Battery voltage is measured by reading the internal 1.1V bandgap against 
+//  the avr's supply, once per update, then low-pass filtered (each reading 
+//  moves the result 1/(2^VCC_FILTER_SHIFT) of the way).  The bandgap is only
+//  good to about 10%; set VCC_BANDGAP_MV to your chip's (measure AREF with 
+//  the bandgap selected, or compare against a multimeter) for better numbers.
+// While the light is on, the cell sags by its current times 
+//  BATTERY_RESISTANCE_MOHM (cell, switch and wiring); that's added back so 
+//  the reading tracks charge, not load.
+#define VCC_BANDGAP_MV 1100
+#define VCC_FILTER_SHIFT 4
+#define BATTERY_RESISTANCE_MOHM 150
+
+// Low battery protection: on battery, the light is capped at MAX_LEVEL above
+//  LOW_BATTERY_MV, falling to LOW_BATTERY_MIN_LEVEL at CRITICAL_BATTERY_MV, so
+//  the driver doesn't brown out on a weak cell.  The cap only rises again once
+//  the battery reads LOW_BATTERY_HYSTERESIS_MV higher.
+#define LOW_BATTERY_MV 3400
+#define CRITICAL_BATTERY_MV 3000
+#define LOW_BATTERY_MIN_LEVEL 150
+#define LOW_BATTERY_HYSTERESIS_MV 50
+// Define to hold brightness steady as the battery drains: the light level is
+//  raised BATTERY_COMPENSATION percent for every 100mV below BATTERY_FULL_MV.
+//#define BATTERY_COMPENSATION 2
+#define BATTERY_FULL_MV 4150
+
+// Overheat protection starts dimming here.  Can be set on the compiler's
+//  command line, to try others in simulation (tools/replay/fleet.py -D).
+#ifndef OVERHEAT_CELSIUS
 #if (DEBUG==DEBUG_TEMP)
-#define OVERHEAT_TEMPERATURE 265 // something lower, to more easily verify algorithms
+#define OVERHEAT_CELSIUS 37 // something lower, to more easily verify algorithms
 #else
-#define OVERHEAT_TEMPERATURE 320 // 340 in original code, 320 = 130* fahrenheit/55* celsius (with calibration)
+#define OVERHEAT_CELSIUS 55 // 130* fahrenheit.  Don't go over 70C/160F.
+#endif
 #endif
 
+// Two-point thermal calibration, kept in the last bytes of EEPROM so sketches
+//  using the rest of it don't collide.  Readings are stored with 3 fractional
+//  bits (the most THERMAL_EXTRA_BITS allows) so a saved calibration survives
+//  changing THERMAL_EXTRA_BITS.  Without a saved calibration, we use the 
+//  original unit's: 153 in an ice bath, 275 at 40C.
+#define THERMAL_CALIBRATION_ADDRESS (E2END+1-6)
+#define THERMAL_CALIBRATION_MAGIC 0xC7
+#define THERMAL_DEFAULT_ZERO (153<<THERMAL_EXTRA_BITS)
+#define THERMAL_DEFAULT_HOT (275<<THERMAL_EXTRA_BITS)
+#define THERMAL_DEFAULT_HOT_CELSIUS 40
+
+
+// LOW and HIGH driver modes overlap: LOW 255 is about HIGH 48.5, so HIGH is
+//  DRV_HIGH_RATIO/100 times brighter at the same pwm.  Where both can make the
+//  requested output, set_light_level uses the mode with the least battery 
+//  current (by the estimates at driver_ma in hexbright.cpp).  It only goes
+//  up into HIGH once that saves DRV_MODE_HYSTERESIS percent, so the mode bit
+//  doesn't chatter, and drops back to LOW as soon as LOW is cheaper.
+#define DRV_HIGH_RATIO 526
+#define DRV_MODE_HYSTERESIS 10
 
 ///////////////////////////////////
 // key points on the light scale //
@@ -96,6 +293,20 @@ either expressed or implied, of the FreeBSD Project.
 #define BATTERY 7
 #define CHARGED 3
 
+// The charge pin reads <128 charging, >768 charged, and floats in between on 
+//  battery.  Leaving a state takes an extra CHARGE_HYSTERESIS, and the new 
+//  state has to hold for CHARGE_DEBOUNCE_MS (the reading passes through the 
+//  battery range when a charged battery starts topping off, and back).
+#define CHARGE_LOW 128
+#define CHARGE_HIGH 768
+#define CHARGE_HYSTERESIS 64
+#define CHARGE_DEBOUNCE_MS 100
+
+// charge events, see get_charge_events
+#define CHARGE_EVENT_PLUGGED 1
+#define CHARGE_EVENT_UNPLUGGED 2
+#define CHARGE_EVENT_COMPLETE 4
+
 class hexbright {
   public: 
     // ms_delay is the time update will try to wait between runs.
@@ -105,7 +316,7 @@ class hexbright {
     //   brightness changes). Set this from 5-30. very low is generally
     //   fine (or great), BUT if you do any printing, the actual delay
     //   may be greater than the value you set.
-    //   Also, the minimum value when working with the accelerometer is 9. (1000/120)
+    //   The accelerometer's sample rate is set separately (set_accelerometer_rate).
     // Don't try to use times smaller than this value in your code.
     //   (setting the on_time for less than update_delay_ms = 0)
     hexbright(int update_delay_ms);
@@ -136,7 +347,8 @@ class hexbright {
     static void set_light(int start_level, int end_level, int time);
     // get light level (before overheat protection adjustment)
     static int get_light_level();
-    // get light level (after overheat protection adjustment)
+    // get light level (after overheat and low battery protection, and 
+    //  battery compensation if enabled)
     static int get_safe_light_level();
 
     // Returns the duration the button has been in updates.  Keeps its value 
@@ -163,29 +375,46 @@ class hexbright {
     static byte flip_color(byte color);
 
 
-    // Get the raw thermal sensor reading. Takes up 18 bytes.
+    // Get the thermal sensor reading (0-1023, filtered). Takes up 18 bytes.
     static int get_thermal_sensor();
+    // Get the thermal sensor reading with THERMAL_EXTRA_BITS more resolution 
+    //  (0-4095 by default).
+    static int get_thermal_sensor_fine();
     // Get the degrees in celsius. I suggest calibrating your sensor, as described
-    //  in programs/temperature_calibration. Takes up 60 bytes
+    //  in programs/temperature_calibration.
     static int get_celsius();
-    // Get the degrees in fahrenheit. After calibrating your sensor, you'll need to
-    //  modify this as well. Takes up 60 bytes
+    // Get the degrees in fahrenheit.
     static int get_fahrenheit();
+    // Calibrate the thermal sensor from two get_thermal_sensor_fine() readings: 
+    //  one at 0C (ice bath) and one at hot_celsius.  The calibration is saved to
+    //  EEPROM and used from then on, including for overheat protection.
+    //  Returns false (and changes nothing) if hot isn't above zero.
+    static boolean set_thermal_calibration(int zero, int hot, byte hot_celsius);
+
+    // Battery voltage in millivolts, filtered and load compensated.
+    static int get_battery_mv();
+    // Rough state of charge (0-100), from get_battery_mv and a typical 
+    //  lithium ion discharge curve.
+    static byte get_battery_percent();
 
     // returns CHARGING, CHARGED, or BATTERY
-    // This reads the charge state twice with a small delay, then returns 
-    //  the actual charge state.  BATTERY will never be returned if we are 
-    //  plugged in.
+    // The charge state is tracked every update, and only changes once a new
+    //  state has held for CHARGE_DEBOUNCE_MS.  BATTERY will never be returned 
+    //  if we are plugged in.
     // Use this if you take actions based on the charge state (example: you
-    //  turn on when you stop charging).  Takes up 56 bytes (34+22).
+    //  turn on when you stop charging).
     static byte get_definite_charge_state();
     // returns CHARGING, CHARGED, or BATTERY
-    // This reads and returns the charge state, without any verification.  
-    //  As a result, it may report BATTERY when switching between CHARGED 
-    //  and CHARGING.
+    // This returns the charge state from this update, without debouncing.  
+    //  As a result, it may briefly report BATTERY when switching between 
+    //  CHARGED and CHARGING.
     // Use this if you don't care if the value is sometimes wrong (charging 
-    //  notification).  Takes up 34 bytes.
+    //  notification).
     static byte get_charge_state();
+    // returns the CHARGE_EVENT_* bits for changes to get_definite_charge_state
+    //  since the last call, then clears them.
+    // if(hb.get_charge_events() & CHARGE_EVENT_UNPLUGGED) // turn on
+    static byte get_charge_events();
 
     
     // prints a number through the rear leds
@@ -196,6 +425,14 @@ class hexbright {
     // currently printing a number
     static boolean printing_number();
 
+    // Record a debug event (see DEBUG_EVENT_SLOTS).  Use ids from EVENT_USER
+    //  up.  With DEBUG off it does nothing, and calls compile away.
+#if (DEBUG!=DEBUG_OFF)
+    static void log_event(byte id, int value);
+#else
+    static void log_event(byte, int) {}
+#endif
+
 #ifdef ACCELEROMETER
     // Accelerometer (in development)
     // good documentation:
@@ -207,15 +444,17 @@ class hexbright {
 
     static void print_accelerometer();
 
-    // last two readings have had less than tolerance acceleration(in Gs)
+    // the last ACC_HISTORY readings have averaged within tolerance of 1 G,
+    //  and have not varied by more than tolerance (in Gs)
     static boolean stationary(double tolerance=.1);
     // last reading had more than tolerance acceleration (in Gs)
     static boolean moved(double tolerance=.5);
 
 
     //returns the angle between straight down and 
-    // returns 0 to 100. 0 == down, 100% == up.  Multiply by 1.8 to get degrees.
-    // expect noise of about 10.
+    // returns 0 to 1. 0 == down, 1 == up.  Multiply by 180 to get degrees.
+    // Down is tracked continuously with a low-pass filter (see 
+    //  set_accelerometer_rate), so this is already smoothed.
     static double difference_from_down();
     static double get_dp();
     static double get_gs(); // Gs of acceleration
@@ -226,7 +465,68 @@ class hexbright {
 
     static double jab_detect(float sensitivity=1);
 
+    // Sets how often the accelerometer samples (ACC_RATE_*), independent of 
+    //  update_delay_ms.  Slower rates save power and cpu time; the filtering 
+    //  is retuned for each rate so the smoothing stays about the same.
+    //  filter (ACC_FILTER_*) trades responsiveness for smoothness.
+    // Taps are only detected at ACC_RATE_120.  Call after init_hardware();
+    //  if you don't, the fastest rate update() can keep up with is used.
+    static void set_accelerometer_rate(byte rate, byte filter=ACC_FILTER_NORMAL);
+
+    // Tell the library which parts of the accelerometer you use (ACC_USE_* 
+    //  flags, combined with |).  Anything unused isn't read, and with nothing
+    //  in use the accelerometer is put in standby.  It is also put in standby
+    //  by shutdown(), unless you ask for ACC_USE_WHILE_OFF.
+    // Defaults to ACC_USE_MOTION | ACC_USE_EVENTS.
+    static void set_accelerometer_use(byte use);
+
+    // Taps, shakes and orientation are detected by the accelerometer itself.
+    //  When it has something to report it raises an interrupt; the TILT 
+    //  register is then read during update(), so this costs nothing otherwise.
+    // Returns the ACC_EVENT_* flags seen since the last call, and clears them.
+    static byte get_accelerometer_events();
+    // returns ACC_FRONT, ACC_BACK, or 0 (unknown)
+    static byte get_facing();
+    // returns ACC_LEFT, ACC_RIGHT, ACC_DOWN, ACC_UP, or 0 (unknown)
+    static byte get_orientation();
+
+    // Statistics over the last ACC_HISTORY samples, for axis 0-2 (x,y,z).
+    // Values are raw readings: 21.3 = 1 G (datasheet page 28).
+    // These are kept as running sums, so calling them is cheap.
+    static int get_accel_mean(byte axis);
+    // returns the variance (the standard deviation squared)
+    static int get_accel_variance(byte axis);
+    static char get_accel_min(byte axis);
+    static char get_accel_max(byte axis);
+    // age 0 is the newest sample, ACC_HISTORY-1 the oldest
+    static char get_accel_sample(byte age, byte axis);
+
+    // Compares the last GESTURE_LENGTH samples against count templates (in 
+    //  PROGMEM), allowing for some difference in speed.  Returns the index of 
+    //  the closest template, or -1 if none are within threshold.
+    // threshold is a percentage of the template's own size: holding still 
+    //  is 100% away from every template, so use something well under 100.
+    //  Takes about 1 ms per template.
+    static char match_gesture(const gesture* templates, byte count, int threshold);
+
+  protected:
+    // update() stages, see hexbright_fixed
+    static void collect_accelerometer();
+    static void update_accelerometer_mode();
+    static void start_accelerometer_read();
+    static void enable_accelerometer();
+    static void init_accelerometer_state();
+
   private:
+    static void push_accel_sample(char* sample);
+    static void track_gravity();
+    static void update_down();
+    static int gesture_distance(char (*window)[3], const gesture* gesture_template, int limit);
+    static void begin_accelerometer_read(byte acc_reg);
+    static void update_motion(byte* reading, byte stale);
+    static void update_tilt(byte tilt);
+    static byte read_accelerometer_register(byte acc_reg);
+    static void write_accelerometer(byte* data, byte count);
     static double angle_difference(double dot_product, double magnitude1, double magnitude2);
     static void normalize(double* out_vector, double* in_vector, double magnitude);
     static void sum_vectors(double* out_vector, double* in_vector1, double* in_vector2);
@@ -236,17 +536,47 @@ class hexbright {
     static int convert_axis_number(byte value);
     static void print_vector(double* vector, char* label);
 
-    static void enable_accelerometer();
     static void disable_accelerometer();
   public:
 #endif
 
+  protected:
+    // The same as set_light, set_led and button_held, with times in updates 
+    //  instead of milliseconds.  hexbright_fixed uses these.
+    static void set_light_ticks(int start_level, int end_level, int ticks);
+    static void set_led_ticks(byte led, int on_ticks, int wait_ticks, byte brightness=255);
+    static int button_held_ticks();
+
+    // init_hardware() and update() are built from these, so hexbright_fixed 
+    //  can leave out the stages (and the code behind them) a sketch doesn't use.
+    static void init_common();
+    // hexbright(int) runs all of these.  hexbright_fixed (which uses the 
+    //  constructor below) runs only the ones its FEATURES need, so the linker 
+    //  can drop the other subsystems' state.
+    static void init_state(int update_delay_ms);
+    static void init_number_state();
+    hexbright() {}
+    // noinline so tools/bench can tell waiting apart from working
+    static void wait_for_update() __attribute__((noinline));
+    static void update_leds();
+    static void read_button();
+    static void update_number();
+    static boolean read_adc();
+    static void update_light();
+
   private: 
     static void adjust_light();
+    static int cap_light_level(int level);
     static void set_light_level(unsigned long level);
     static void overheat_protection();
+    static void low_battery_protection();
+    static int battery_cap(int mv);
+    static void load_thermal_calibration();
+    static void apply_thermal_calibration(int zero, int hot, byte hot_celsius);
 
-    static void update_number();
+    static void send_events();
+    static void init_telemetry();
+    static void send_telemetry();
 
     // controls actual led hardware set.  
     //  As such, state = HIGH or LOW
@@ -255,9 +585,100 @@ class hexbright {
     static void _led_off(byte led);
     static void adjust_leds();
 
-    static void read_thermal_sensor();
-    
-    static void read_button();
+    static void adc_sleep();
+    static void filter_thermal(unsigned int round_sum);
+    static void track_charge(int value);
+    static void filter_vcc(int reading);
+    static int battery_load_ma();
+    static int driver_ma(byte mode, int pwm);
+    static void commit_driver(byte mode, byte pwm);
+};
+
+
+// hexbright with the update period and features fixed at compile time:
+//   hexbright_fixed<10> hb;
+// instead of hexbright hb(10).  set_light, set_led and button_held convert
+//  between milliseconds and updates with a constant instead of ms_delay.  
+//  button_held's multiply gets cheaper, but at -Os (as Arduino builds) 
+//  time/MS still calls the 16 bit division routine unless MS is a power of
+//  2, which becomes a shift.
+// FEATURES picks the subsystems this sketch uses (FEATURE_* above, all of 
+//  them by default):
+//   hexbright_fixed<20, FEATURE_LED> hb; // no number printing or accelerometer
+// Stages left out aren't called from update(), so the linker drops them and 
+//  everything only they use.  A feature also needs its #define above.
+template<int MS, byte FEATURES=FEATURE_ALL>
+class hexbright_fixed : public hexbright {
+  public:
+    hexbright_fixed() {
+      init_state(MS);
+#if (defined(LED) && defined(PRINT_NUMBER))
+      if((FEATURES & FEATURE_LED) && (FEATURES & FEATURE_PRINT_NUMBER))
+        init_number_state();
+#endif
+#ifdef ACCELEROMETER
+      if(FEATURES & FEATURE_ACCELEROMETER)
+        init_accelerometer_state();
+#endif
+    }
+
+    static void init_hardware() {
+      init_common();
+#ifdef ACCELEROMETER
+      if(FEATURES & FEATURE_ACCELEROMETER)
+        enable_accelerometer();
+#endif
+    }
+
+    static void update() {
+      wait_for_update();
+#ifdef LED
+      if(FEATURES & FEATURE_LED)
+        update_leds();
+      else
+        read_button();
+#ifdef PRINT_NUMBER
+      if((FEATURES & FEATURE_LED) && (FEATURES & FEATURE_PRINT_NUMBER))
+        update_number();
+#endif
+#else
+      read_button();
+#endif
+      read_adc();
+#ifdef ACCELEROMETER
+      if(FEATURES & FEATURE_ACCELEROMETER)
+        collect_accelerometer();
+#endif
+      update_light();
+#ifdef ACCELEROMETER
+      if(FEATURES & FEATURE_ACCELEROMETER) {
+        update_accelerometer_mode();
+        start_accelerometer_read();
+      }
+#endif
+    }
+
+    static void set_light(int start_level, int end_level, int time) {
+      set_light_ticks(start_level, end_level, time/MS);
+    }
+    static void set_led(byte led, int on_time, int wait_time=100, byte brightness=255) {
+      set_led_ticks(led, on_time/MS, wait_time/MS, brightness);
+    }
+    static int button_held() {
+      return button_held_ticks()*MS;
+    }
 };
 
+#ifndef __AVR__
+// Host builds only (tools/replay): the library's state, one per virtual 
+//  light.  Each thread runs the state it last selected (a default one until
+//  then); hexbright's constructor (or hexbright_fixed's) resets the 
+//  selected state.  Interrupts run on the thread that caused them, so they 
+//  find the same state.
+struct hexbright_state;
+hexbright_state* hexbright_new_state();
+void hexbright_delete_state(hexbright_state* state);
+void hexbright_select_state(hexbright_state* state); // NULL for the default
+#endif
 
+#endif
@@ -1,4 +1,3 @@
-#include <Wire.h>
 // uncomment '#define ACCELEROMETER' in hexbright.h
 #include <hexbright.h>
 
@@ -11,42 +10,35 @@ void setup() {
 
 void loop() {
   hb.update();
+  byte events = hb.get_accelerometer_events();
   if(hb.button_held()) {
     // http://cache.freescale.com/files/sensors/doc/data_sheet/MMA7660FC.pdf (look at page 14)
-    byte tilt = hb.read_accelerometer(ACC_REG_TILT);
-    print_binary(tilt);
-    if(tilt & B01000000) {
-      Serial.println("Bad read (accelerometer was writing to the register)");
-      return;
-    } 
-    if(tilt & B10000000) {
+    if(events & ACC_EVENT_SHAKE) {
       Serial.println("Shake!");
     } 
-    if(tilt & B00100000) {
+    if(events & ACC_EVENT_TAP) {
       Serial.println("Tap!");
     }
-    if(tilt & B00000001) {
-      Serial.println("Lying on front");      
-    }
-    if(tilt & B00000010) {
-      Serial.println("Lying on back");      
-    }
-    if(tilt & B00011100 == B00000100) {
-      Serial.println("Left landscape");      
-    }
-    if(tilt & B00011100 == B00010100) {
-      Serial.println("Right landscape");      
-    }
-    if(tilt & B00011100 == B00010100) {
-      Serial.println("Down");      
-    }
-    if(tilt & B00011100 == B00011000) {
-      Serial.println("Up");      
+    if(events & ACC_EVENT_ORIENTATION) {
+      if(hb.get_facing()==ACC_FRONT) {
+        Serial.println("Lying on front");      
+      } else if(hb.get_facing()==ACC_BACK) {
+        Serial.println("Lying on back");      
+      }
+      byte orientation = hb.get_orientation();
+      if(orientation == ACC_LEFT) {
+        Serial.println("Left landscape");      
+      } else if(orientation == ACC_RIGHT) {
+        Serial.println("Right landscape");      
+      } else if(orientation == ACC_DOWN) {
+        Serial.println("Down");      
+      } else if(orientation == ACC_UP) {
+        Serial.println("Up");      
+      }
     }
   } else {
     // http://cache.freescale.com/files/sensors/doc/app_note/AN3461.pdf
-    hb.read_accelerometer_vector();
-    hb.print_vector(); // and dot product
+    hb.print_accelerometer(); // and dot product
   }
 }
 
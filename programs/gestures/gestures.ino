@@ -0,0 +1,89 @@
+/*
+Copyright (c) 2012, "David Hilton" <dhiltonp@gmail.com>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met: 
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies, 
+either expressed or implied, of the FreeBSD Project.
+*/
+
+#include <hexbright.h>
+
+// Gesture control, and a recorder for making your own gesture templates.
+//
+// Flick the light to turn it on (or brighter), twist it to dim it, and tap 
+//  the tail on a table twice to turn it off.
+// While the button is held, raw accelerometer readings are printed over 
+//  serial, one recording per press.  Make the gesture, hold still for a 
+//  moment, then release.  Feed the saved output to tools/gesture_template.py.
+
+#include <gestures.h>
+
+// the templates in gestures.h assume about 18 ms
+hexbright hb(18);
+
+#define GESTURE_THRESHOLD 50 // percent
+
+void setup() {
+  hb.init_hardware();
+  Serial.begin(9600);
+}
+
+int level = 0;
+int quiet = 0; // don't match the same motion twice
+
+void loop() {
+  hb.update();
+
+  if(hb.button_held()) {
+    for(int i=0; i<3; i++) {
+      Serial.print((int)hb.get_accel_sample(0, i));
+      Serial.print(i<2 ? "," : "\n");
+    }
+    if(hb.button_released())
+      Serial.println();
+    return;
+  }
+
+  if(quiet) {
+    quiet--;
+    return;
+  }
+  char match = hb.match_gesture(gesture_templates, 3, GESTURE_THRESHOLD);
+  if(match == GESTURE_FLICK) {
+    level = level<250 ? 250 : min(level*2, MAX_LEVEL);
+  } else if(match == GESTURE_TWIST) {
+    level = level/2;
+  } else if(match == GESTURE_DOUBLE_TAP) {
+    level = 0;
+  } else {
+    return;
+  }
+  quiet = GESTURE_LENGTH;
+  if(level) {
+    hb.set_light(CURRENT_LEVEL, level, 200);
+  } else {
+    hb.set_light(CURRENT_LEVEL, 0, NOW);
+    hb.shutdown();
+  }
+}
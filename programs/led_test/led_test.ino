@@ -1,5 +1,3 @@
-#include <Wire.h>
-
 #include <hexbright.h>
 
 hexbright hb(50);
@@ -28,20 +28,52 @@ either expressed or implied, of the FreeBSD Project.
 */
 
 #include <hexbright.h>
-#include <Wire.h>
 
+// the temperature of your warm bath, as measured by a good thermometer
+#define CALIBRATION_HOT_CELSIUS 40
 
 hexbright hb(5);
 
+// Each button press moves to the next step.  Until the step is done, the 
+//  tail LEDs show the raw sensor reading.
+#define FIND_ZERO 0 // in the ice bath: press once the reading stabilizes
+#define FIND_HOT 1  // in the warm bath: press once the reading stabilizes
+#define CALIBRATED 2 // show the calibrated temperature
+byte step = FIND_ZERO;
+int zero_reading;
+
 void setup() {
   hb.init_hardware();
 }
 
 void loop() {
   hb.update();
+
+  if(hb.button_released()) {
+    if(step==FIND_ZERO) {
+      zero_reading = hb.get_thermal_sensor_fine();
+      step = FIND_HOT;
+    } else if(step==FIND_HOT) {
+      if(hb.set_thermal_calibration(zero_reading, hb.get_thermal_sensor_fine(), CALIBRATION_HOT_CELSIUS)) {
+        step = CALIBRATED;
+      } else {
+        // the warm reading wasn't above the cold one; start over
+        hb.set_led(RLED, 1000);
+        step = FIND_ZERO;
+      }
+    } else {
+      // press again to redo the calibration
+      step = FIND_ZERO;
+    }
+  }
+
   if(!hb.printing_number()) {
-    hb.print_number(hb.get_thermal_sensor());
-//    hb.print_number(hb.get_fahrenheit());
+    if(step==CALIBRATED) {
+      hb.print_number(hb.get_celsius());
+//      hb.print_number(hb.get_fahrenheit());
+    } else {
+      hb.print_number(hb.get_thermal_sensor());
+    }
   }
 }
 
@@ -1,9 +1,7 @@
 #include <hexbright.h>
 
-#include <Wire.h>
-
 #define MS 20
-hexbright hb(MS);
+hexbright_fixed<MS, FEATURE_LED> hb;
 
 #define OFF_MODE 0
 #define CHARGE_MODE 1
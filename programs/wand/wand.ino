@@ -1,5 +1,3 @@
-#include <Wire.h>
-
 // uncomment #ACCELEROMETER in hexbright.h
 #include <hexbright.h>
 
@@ -0,0 +1,145 @@
+#!/usr/bin/env python
+"""
+Times the hexbright library's entry points, cycle for cycle, under simavr.
+
+  python tools/bench/bench.py [--arduino DIR] [--seconds 5] [-o results.json]
+                              [--compare old.json]
+
+Builds tools/bench/entry_points (which calls each entry point every
+update) for the atmega168, runs it under simrun, and writes the cycles
+each function took as json:
+
+  {"mcu": "atmega168", "f_cpu": 8000000, "seconds": 5,
+   "avr_gcc": "avr-gcc (GCC) 4.3.2", "simavr": "1.6",
+   "features": "full", "flash": 12345, "ram": 456, "stack": 123,
+   "functions": {"update": {"count": 499, "avg": 2101, "min": 1810, "max": 9120,
+                            "avg_us": 262.6}, ...}}
+
+update() doesn't include waiting for the next update (wait_for_update).
+Functions that never ran (compiled out by the feature set, or never
+called) are left out.  With --compare, also prints the change in average
+cycles from an earlier run.
+
+The reference run is tools/bench/baseline.json, and --compare uses it
+when it's there.  It has to come from a machine with avr-gcc and simavr,
+and isn't in the tree until someone has one to make it:
+
+  python tools/bench/bench.py -o tools/bench/baseline.json
+
+The avr-gcc and simavr versions are recorded in the json (simavr's from
+pkg-config; null if it can't tell), and --compare warns when they differ,
+since a new compiler moves the numbers on its own.  Remake and commit the
+baseline alongside any change that moves the numbers on purpose.
+
+Needs the same tools as budget.py, including simavr.
+"""
+
+import json
+import optparse
+import os
+import shutil
+import sys
+import tempfile
+
+import budget
+
+# hexbright:: functions to time (by name, so each should have one overload)
+ENTRY_POINTS = ['update', 'set_light', 'set_light_level', 'print_number', 'get_celsius',
+                'get_battery_mv', 'read_accelerometer_vector', 'jab_detect',
+                'collect_accelerometer', 'read_adc']
+EXCLUDED = ['wait_for_update']
+SKETCH = os.path.join(budget.BENCH, 'entry_points', 'entry_points.ino')
+BASELINE = os.path.join(budget.BENCH, 'baseline.json')
+
+
+def find(syms, name):
+    prefix = 'hexbright::%s(' % name
+    for sym, addr in syms.items():
+        if sym.startswith(prefix):
+            return addr
+    return None
+
+
+def compare(results, old):
+    for tool in ['avr_gcc', 'simavr']:
+        if old.get(tool) != results[tool]:
+            print('note: %s was %s, now %s' % (tool, old.get(tool), results[tool]))
+    print('%-28s %10s %10s %8s' % ('function', 'old avg', 'new avg', 'change'))
+    for name in sorted(set(results['functions']) | set(old.get('functions', {}))):
+        new = results['functions'].get(name, {}).get('avg')
+        was = old.get('functions', {}).get(name, {}).get('avg')
+        change = '%+.1f%%' % (100.0 * (new - was) / was) if new and was else ''
+        print('%-28s %10s %10s %8s' % (name, was if was is not None else '-',
+                                       new if new is not None else '-', change))
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('--arduino', default=os.environ.get('ARDUINO_DIR', '/usr/share/arduino'),
+                      help='arduino install (default $ARDUINO_DIR or /usr/share/arduino)')
+    parser.add_option('--seconds', type='float', default=5,
+                      help='simulated time (default 5)')
+    parser.add_option('--features', default='full',
+                      help='library feature set, as named by budget.py (default full)')
+    parser.add_option('-o', '--output', help='write the json here instead of stdout')
+    parser.add_option('--compare', metavar='JSON',
+                      help='print changes from an earlier run (default baseline.json, if there is one)')
+    parser.add_option('--keep', metavar='DIR', help='build in DIR and keep it')
+    options, args = parser.parse_args()
+    if options.compare is None and options.features == 'full' and os.path.exists(BASELINE) and \
+            os.path.abspath(options.output or '') != BASELINE:
+        options.compare = BASELINE
+
+    flags = dict(budget.feature_sets()).get(options.features)
+    if flags is None:
+        sys.exit('unknown feature set %r; try one of: %s' %
+                 (options.features, ', '.join(n for n, f in budget.feature_sets())))
+
+    tools = budget.Tools(options.arduino)
+    build = options.keep or tempfile.mkdtemp(prefix='hexbright-bench-')
+    if not os.path.isdir(build):
+        os.makedirs(build)
+    core = budget.build_core(tools, build)
+    simrun = budget.build_simrun(build)
+    elf, output = budget.build_sketch(tools, core, SKETCH, flags,
+                                      os.path.join(build, 'entry_points'), options.arduino)
+    if elf is None:
+        sys.exit('building entry_points failed:\n' + output)
+    sys.stderr.write(output)  # warnings
+
+    syms = budget.symbols(tools, elf)
+    functions = []
+    for name in ENTRY_POINTS:
+        addr = find(syms, name)
+        if addr is not None:
+            functions.append('%s=%#x' % (name, addr))
+    for name in EXCLUDED:
+        addr = find(syms, name)
+        if addr is not None:
+            functions.append('-%s=%#x' % (name, addr))
+    calls, stack = budget.simulate(simrun, elf, syms['_end'], functions, options.seconds)
+
+    flash, ram = budget.sizes(tools, elf)
+    results = {'mcu': budget.MCU, 'f_cpu': budget.F_CPU, 'seconds': options.seconds,
+               'avr_gcc': tools.version('avr-gcc'), 'simavr': budget.simavr_version(),
+               'features': options.features, 'flash': flash, 'ram': ram, 'stack': stack,
+               'functions': {}}
+    for name, call in calls.items():
+        if call['count']:
+            call['avg_us'] = round(call['avg'] * 1e6 / budget.F_CPU, 1)
+            results['functions'][name] = call
+
+    text = json.dumps(results, indent=2, sort_keys=True)
+    if options.output:
+        open(options.output, 'w').write(text + '\n')
+    else:
+        print(text)
+    if options.compare:
+        compare(results, json.load(open(options.compare)))
+
+    if not options.keep:
+        shutil.rmtree(build)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,324 @@
+#!/usr/bin/env python
+"""
+Builds every sketch in programs/ for the hexbright under each library
+feature set, and checks it against the hardware's budgets:
+
+  flash     .text+.data, against upload.maximum_size in hardware/hexbright/boards.txt
+  ram       .data+.bss plus the stack high-water mark, against the 1 KB of sram
+  cycles    the slowest update() (loop() minus waiting), against the
+            sketch's update period
+
+  python tools/bench/budget.py [--arduino DIR] [--seconds 2] [--no-sim] [sketch ...]
+
+Feature sets turn off the LED, PRINT_NUMBER and ACCELEROMETER defines in
+hexbright.h (with -DHEXBRIGHT_NO_LED and so on).  A sketch that needs a
+feature that's off doesn't build; that's reported as n/a, not a failure.
+Any other build error (the full set, or a sketch that doesn't use the
+library) is printed, and is a failure.  Compiler warnings are printed
+under the sketch (the arduino core's aren't), but don't fail it.
+
+Needs avr-gcc, avr-g++, avr-ar, avr-size and avr-nm (on the PATH, or the
+ones bundled with arduino), the arduino core (--arduino, or $ARDUINO_DIR),
+and for the stack and cycle columns, simavr (libsimavr and its headers,
+used to build simrun.c).  Exits 1 if anything is over budget.
+
+bench.py times individual library functions the same way.
+"""
+
+import itertools
+import optparse
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), '..', '..'))
+BENCH = os.path.dirname(os.path.abspath(__file__))
+LIBRARIES = os.path.join(ROOT, 'libraries')
+
+MCU = 'atmega168'
+F_CPU = 8000000
+RAM = 1024
+CFLAGS = ['-c', '-g', '-Os', '-fno-exceptions', '-ffunction-sections',
+          '-fdata-sections', '-mmcu=' + MCU, '-DF_CPU=%dL' % F_CPU, '-DARDUINO=100']
+FEATURES = ['LED', 'PRINT_NUMBER', 'ACCELEROMETER']
+
+
+def flash_budget():
+    boards = open(os.path.join(ROOT, 'hardware', 'hexbright', 'boards.txt')).read()
+    return int(re.search(r'hexbright\.upload\.maximum_size=(\d+)', boards).group(1))
+
+
+def feature_sets():
+    """(name, flags) for each distinct combination; PRINT_NUMBER needs LED."""
+    sets = []
+    for off in itertools.product([False, True], repeat=len(FEATURES)):
+        off = dict(zip(FEATURES, off))
+        if off['LED'] and not off['PRINT_NUMBER']:
+            continue  # same as turning both off
+        names = [f for f in FEATURES if off[f]]
+        sets.append(('no ' + '+'.join(n.lower() for n in names) if names else 'full',
+                     ['-DHEXBRIGHT_NO_' + n for n in names]))
+    return sets
+
+
+class Tools(object):
+    def __init__(self, arduino):
+        self.arduino = arduino
+        bundled = os.path.join(arduino, 'hardware', 'tools', 'avr', 'bin')
+        self.path = {}
+        for tool in ['avr-gcc', 'avr-g++', 'avr-ar', 'avr-size', 'avr-nm']:
+            local = os.path.join(bundled, tool)
+            self.path[tool] = local if os.path.exists(local) else tool
+        self.core = os.path.join(arduino, 'hardware', 'arduino', 'cores', 'arduino')
+        self.variant = os.path.join(arduino, 'hardware', 'arduino', 'variants', 'standard')
+
+    def run(self, tool, args, cwd=None):
+        proc = subprocess.Popen([self.path[tool]] + args, cwd=cwd,
+                                stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        out = proc.communicate()[0].decode('utf-8', 'replace')
+        return proc.returncode, out
+
+    def version(self, tool):
+        """The first line of tool --version, or None if it won't run."""
+        try:
+            code, out = self.run(tool, ['--version'])
+        except OSError:
+            return None
+        return out.splitlines()[0].strip() if out.strip() else None
+
+    def compile(self, source, obj, includes, flags=()):
+        tool = 'avr-gcc' if source.endswith('.c') else 'avr-g++'
+        args = CFLAGS + list(flags) + ['-I' + i for i in includes] + [source, '-o', obj]
+        return self.run(tool, args)
+
+
+def sources(directory):
+    found = []
+    for sub in ['', 'utility']:
+        d = os.path.join(directory, sub)
+        if os.path.isdir(d):
+            found += [os.path.join(d, f) for f in sorted(os.listdir(d))
+                      if f.endswith('.c') or f.endswith('.cpp')]
+    return found
+
+
+def build_core(tools, build):
+    objs = []
+    for src in sources(tools.core):
+        obj = os.path.join(build, os.path.basename(src) + '.o')
+        # (not our code, so not our warnings)
+        code, out = tools.compile(src, obj, [tools.core, tools.variant], ['-w'])
+        if code:
+            sys.exit('building the arduino core failed:\n' + out)
+        objs.append(obj)
+    core = os.path.join(build, 'core.a')
+    tools.run('avr-ar', ['rcs', core] + objs)
+    return core
+
+
+def strip_comments(text):
+    text = re.sub(r'/\*.*?\*/', '', text, flags=re.S)
+    return re.sub(r'//[^\n]*', '', text)
+
+
+PROTOTYPE = re.compile(r'^([A-Za-z_][\w:<>]*(?:[ \t\*&]+[\w:<>]+)*?[ \t\*&]+(\w+)\s*\([^;{}()]*\))\s*\{',
+                       re.M)
+
+
+def preprocess(sketch):
+    """What the arduino ide does to a .ino: include Arduino.h, and declare
+    the functions so they can be used before they're defined."""
+    text = open(sketch).read()
+    prototypes = [m.group(1) + ';' for m in PROTOTYPE.finditer(strip_comments(text))
+                  if m.group(2) not in ('setup', 'loop', 'if', 'while', 'for', 'switch')]
+    lines = text.split('\n')
+    last_include = max([i for i, l in enumerate(lines) if l.startswith('#include')] or [-1])
+    head = '\n'.join(lines[:last_include + 1])
+    body = '\n'.join(lines[last_include + 1:])
+    return ('#include <Arduino.h>\n#line 1 "%s"\n%s\n%s\n#line %d\n%s\n' %
+            (sketch, head, '\n'.join(prototypes), last_include + 2, body))
+
+
+def libraries_used(text, arduino):
+    dirs = []
+    for name in re.findall(r'#include\s*[<"](\w+)\.h[>"]', text):
+        for base in [LIBRARIES, os.path.join(arduino, 'libraries')]:
+            d = os.path.join(base, name)
+            if os.path.isdir(d) and d not in dirs:
+                dirs.append(d)
+    return dirs
+
+
+def update_period(text):
+    """The sketch's update delay in ms, or None if we can't tell."""
+    m = (re.search(r'hexbright_fixed\s*<\s*(\w+)', text) or
+         re.search(r'hexbright\s+\w+\s*\(\s*(\w+)\s*\)', text))
+    if not m:
+        return None
+    value = m.group(1)
+    define = re.search(r'#define\s+%s\s+(\d+)' % re.escape(value), text)
+    if define:
+        value = define.group(1)
+    return int(value) if value.isdigit() else None
+
+
+def sizes(tools, elf):
+    code, out = tools.run('avr-size', ['-A', elf])
+    section = dict((l.split()[0], int(l.split()[1])) for l in out.splitlines()
+                   if l.startswith('.') and len(l.split()) >= 2)
+    text, data, bss = section.get('.text', 0), section.get('.data', 0), section.get('.bss', 0)
+    return text + data, data + bss
+
+
+def symbols(tools, elf):
+    code, out = tools.run('avr-nm', ['-C', elf])
+    found = {}
+    for line in out.splitlines():
+        # undefined (and weak undefined) symbols have no address, and
+        #  demangled names can have spaces in them
+        m = re.match(r'([0-9a-fA-F]+) \S (.+)$', line)
+        if m:
+            found[m.group(2)] = int(m.group(1), 16)
+    return found
+
+
+def simavr_version():
+    out = subprocess.Popen('pkg-config --modversion simavr 2>/dev/null', shell=True,
+                           stdout=subprocess.PIPE).communicate()[0].decode().strip()
+    return out or None
+
+
+def build_simrun(build):
+    simrun = os.path.join(build, 'simrun')
+    cflags = subprocess.Popen('pkg-config --cflags --libs simavr 2>/dev/null', shell=True,
+                              stdout=subprocess.PIPE).communicate()[0].decode().split()
+    if not cflags:
+        cflags = ['-I/usr/include/simavr', '-I/usr/local/include/simavr', '-lsimavr', '-lelf']
+    cmd = ['cc', '-O2', '-std=gnu99', '-Wall', os.path.join(BENCH, 'simrun.c'), '-o', simrun] + cflags
+    if subprocess.call(cmd):
+        sys.exit('building simrun.c failed; is simavr installed?  (or use --no-sim)')
+    return simrun
+
+
+def simulate(simrun, elf, ram_start, functions, seconds):
+    """Runs elf under simrun, timing functions ([name=addr, ...]).  Returns
+    ({name: {count, avg, min, max}}, stack high-water in bytes)."""
+    out = subprocess.Popen([simrun, elf, MCU, str(F_CPU), str(seconds), hex(ram_start)] + functions,
+                           stdout=subprocess.PIPE).communicate()[0].decode()
+    calls = {}
+    for m in re.finditer(r'call (\S+) count (\d+) avg (\d+) min (\d+) max (\d+)', out):
+        calls[m.group(1)] = dict(zip(['count', 'avg', 'min', 'max'], map(int, m.groups()[1:])))
+    stack = re.search(r'stack (\d+)', out)
+    return calls, stack and int(stack.group(1))
+
+
+def build_sketch(tools, core, sketch, flags, out_dir, arduino):
+    """Builds sketch (an .ino) with its libraries.  Returns (elf, warnings),
+    or (None, compiler output) if it doesn't build."""
+    name = os.path.splitext(os.path.basename(sketch))[0]
+    if not os.path.isdir(out_dir):
+        os.makedirs(out_dir)
+    libs = libraries_used(open(sketch).read(), arduino)
+    cpp = os.path.join(out_dir, name + '.cpp')
+    open(cpp, 'w').write(preprocess(sketch))
+    includes = [os.path.dirname(sketch), tools.core, tools.variant] + libs + \
+        [os.path.join(l, 'utility') for l in libs]
+    objs = []
+    warnings = ''
+    for src in [cpp] + sum([sources(l) for l in libs], []):
+        obj = os.path.join(out_dir, os.path.basename(src) + '.o')
+        code, out = tools.compile(src, obj, includes, flags)
+        if code:
+            return None, out
+        warnings += out
+        objs.append(obj)
+    elf = os.path.join(out_dir, name + '.elf')
+    code, out = tools.run('avr-gcc', ['-Os', '-Wl,--gc-sections', '-mmcu=' + MCU,
+                                      '-o', elf] + objs + [core, '-lm'])
+    if code:
+        return None, out
+    return elf, warnings
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] [sketch ...]')
+    parser.add_option('--arduino', default=os.environ.get('ARDUINO_DIR', '/usr/share/arduino'),
+                      help='arduino install (default $ARDUINO_DIR or /usr/share/arduino)')
+    parser.add_option('--seconds', type='float', default=2,
+                      help='simulated time per sketch (default 2)')
+    parser.add_option('--no-sim', action='store_true', help="skip the stack and cycle columns")
+    parser.add_option('--keep', metavar='DIR', help='build in DIR and keep it')
+    options, names = parser.parse_args()
+
+    tools = Tools(options.arduino)
+    build = options.keep or tempfile.mkdtemp(prefix='hexbright-bench-')
+    if not os.path.isdir(build):
+        os.makedirs(build)
+    core = build_core(tools, build)
+    simrun = None if options.no_sim else build_simrun(build)
+    flash_max = flash_budget()
+
+    programs = os.path.join(ROOT, 'programs')
+    names = names or sorted(os.listdir(programs))
+    print('%-24s %-32s %6s %5s %5s %6s %8s %8s  %s' %
+          ('sketch', 'features', 'flash', 'ram', 'stack', 'ms', 'avg cyc', 'max cyc', ''))
+    failed = False
+    for name in names:
+        sketch = os.path.join(programs, name, name + '.ino')
+        text = open(sketch).read()
+        uses_hexbright = os.path.join(LIBRARIES, 'hexbright') in libraries_used(text, options.arduino)
+        period = update_period(text)
+        builds = False
+        shown = set()  # warnings already printed for this sketch
+        for features, flags in (feature_sets() if uses_hexbright else [('-', [])]):
+            out_dir = os.path.join(build, name, re.sub(r'\W+', '_', features))
+            elf, output = build_sketch(tools, core, sketch, flags, out_dir, options.arduino)
+            if elf is None:
+                # the sets only differ by their -D flags, so if it built with
+                #  everything on, this one needs something that's off
+                if builds:
+                    print('%-24s %-32s %6s' % (name, features, 'n/a'))
+                else:
+                    print('%-24s %-32s %6s  FAILED:\n%s' % (name, features, '-', output.rstrip()))
+                    failed = True
+                    break  # the other sets would fail the same way
+                continue
+            builds = True  # full (or -) comes first
+            flash, ram = sizes(tools, elf)
+            sim = None
+            syms = symbols(tools, elf)
+            wait = syms.get('hexbright::wait_for_update()')
+            if simrun and 'loop' in syms and wait is not None:
+                calls, stack = simulate(simrun, elf, syms['_end'],
+                                        ['loop=%#x' % syms['loop'], '-wait=%#x' % wait],
+                                        options.seconds)
+                if 'loop' in calls and stack is not None:
+                    sim = dict(calls['loop'], stack=stack)
+
+            problems = []
+            if flash > flash_max:
+                problems.append('flash over %d' % flash_max)
+            stack = sim['stack'] if sim else 0
+            if ram + stack > RAM:
+                problems.append('ram over %d' % RAM)
+            if sim and period and sim['max'] > period * F_CPU // 1000:
+                problems.append('update over %d ms' % period)
+            failed = failed or bool(problems)
+            print('%-24s %-32s %6d %5d %5s %6s %8s %8s  %s' % (
+                name, features, flash, ram, sim['stack'] if sim else '-',
+                period or '?', sim['avg'] if sim else '-', sim['max'] if sim else '-',
+                'OVER: ' + ', '.join(problems) if problems else 'ok'))
+            if output.strip() and output not in shown:
+                shown.add(output)
+                print('  ' + output.rstrip().replace('\n', '\n  '))
+
+    if not options.keep:
+        shutil.rmtree(build)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
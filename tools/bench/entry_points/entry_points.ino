@@ -0,0 +1,35 @@
+// Calls the library's main entry points every update, so tools/bench/bench.py
+//  can time them under the simulator.  Not meant for a real light (it 
+//  turns on and flashes without being asked).
+// The results go into volatile variables so the compiler can't drop the calls.
+
+#include <hexbright.h>
+
+hexbright hb(10);
+
+volatile int sink_int;
+volatile double sink_double;
+int level = 0;
+
+void setup() {
+  hb.init_hardware();
+}
+
+void loop() {
+  hb.update();
+
+  // a new fade every update, walking through both driver modes
+  level = (level+37)%1000;
+  hb.set_light(CURRENT_LEVEL, level, 100);
+
+  if(!hb.printing_number())
+    hb.print_number(1234);
+
+  sink_int = hb.get_celsius();
+  sink_int = hb.get_battery_mv();
+
+#ifdef ACCELEROMETER
+  hb.read_accelerometer_vector();
+  sink_double = hb.jab_detect();
+#endif
+}
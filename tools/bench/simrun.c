@@ -0,0 +1,237 @@
+/*
+Runs a sketch (an avr elf) under simavr and counts the cycles spent in
+chosen functions, and how deep the stack got.  Built and driven by
+budget.py and bench.py:
+
+  simrun sketch.elf mcu f_cpu seconds ram_start name=addr [-name=addr ...]
+
+addr is a function's flash (byte) address, from avr-nm; ram_start is the
+end of .bss (_end).  Each call of a named function is timed from entry
+to return, including anything it calls and any interrupts that land
+inside it (they're part of the cost).  Time spent in a function named
+with a leading '-' is taken back out of everything that called it;
+budget.py uses that for hexbright::wait_for_update, since waiting for
+the next update isn't work.
+
+Calls are tracked by the stack pointer: a function has returned once SP
+is above where it was on entry.  A function that's already running isn't
+counted again until it returns (no recursion in this library).
+
+Before running, RAM between ram_start and RAMEND is painted; the lowest
+byte that changed afterwards is the stack high-water mark.
+
+The hardware around the avr is faked just enough for the library to see
+something sensible: the supply is 3.7V, the thermal sensor reads 25C, the
+charge pin floats (on battery), and an MMA7660 accelerometer at 0x4C
+reads 1G on z, with a little noise on x and y.
+
+Output, one line per function, then the stack:
+  call <name> count <n> avg <cycles> min <cycles> max <cycles>
+  stack <bytes>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "avr_adc.h"
+#include "avr_twi.h"
+
+#define PAINT 0xA5
+#define MAX_FUNCTIONS 32
+
+typedef struct {
+  const char* name;
+  avr_flashaddr_t addr;
+  int excluded; // time in here doesn't count against callers
+  int active;
+  uint16_t sp;
+  avr_cycle_count_t start;
+  avr_cycle_count_t excluded_cycles; // spent in excluded functions during this call
+  unsigned long count;
+  avr_cycle_count_t total, min, max;
+} function_t;
+
+static function_t functions[MAX_FUNCTIONS];
+static int function_count = 0;
+
+static uint16_t get_sp(avr_t* avr) {
+  return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+///////////////////////////////////////////////
+////////////////ACCELEROMETER//////////////////
+///////////////////////////////////////////////
+
+#define ACC_ADDRESS 0x4C
+
+typedef struct {
+  avr_irq_t* irq;
+  uint8_t selected;  // address byte (with the r/w bit) while we're being talked to
+  uint8_t reg;       // register pointer, auto-increments
+  int got_reg;       // the first byte written selects the register
+  uint8_t regs[11];
+  unsigned seed;
+} mma7660_t;
+
+static mma7660_t acc;
+
+static uint8_t mma7660_read(mma7660_t* p) {
+  if(p->reg <= 2) { // x, y, z: 6 bit two's complement, 21.3 = 1G
+    p->seed = p->seed * 1103515245 + 12345;
+    int noise = (int)((p->seed >> 16) % 3) - 1;
+    int value = p->reg == 2 ? 21 + noise : noise;
+    return value & 0x3F;
+  }
+  return p->reg < sizeof(p->regs) ? p->regs[p->reg] : 0;
+}
+
+static void mma7660_hook(avr_irq_t* irq, uint32_t value, void* param) {
+  mma7660_t* p = (mma7660_t*)param;
+  avr_twi_msg_irq_t v;
+  v.u.v = value;
+
+  if(v.u.twi.msg & TWI_COND_STOP)
+    p->selected = 0;
+  if(v.u.twi.msg & TWI_COND_START) {
+    p->selected = 0;
+    if((v.u.twi.addr >> 1) == ACC_ADDRESS) {
+      p->selected = v.u.twi.addr;
+      p->got_reg = 0;
+      avr_raise_irq(p->irq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_ACK, p->selected, 1));
+    }
+  }
+  if(!p->selected)
+    return;
+  if(v.u.twi.msg & TWI_COND_WRITE) {
+    avr_raise_irq(p->irq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_ACK, p->selected, 1));
+    if(!p->got_reg) {
+      p->reg = v.u.twi.data;
+      p->got_reg = 1;
+    } else {
+      if(p->reg < sizeof(p->regs))
+        p->regs[p->reg] = v.u.twi.data;
+      p->reg++;
+    }
+  }
+  if(v.u.twi.msg & TWI_COND_READ) {
+    uint8_t data = mma7660_read(p);
+    p->reg++;
+    avr_raise_irq(p->irq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_READ, p->selected, data));
+  }
+}
+
+static void attach_mma7660(avr_t* avr) {
+  static const char* names[2] = {"twi.in", "twi.out"};
+  memset(&acc, 0, sizeof(acc));
+  acc.irq = avr_alloc_irq(&avr->irq_pool, 0, 2, names);
+  avr_irq_register_notify(acc.irq + TWI_IRQ_OUTPUT, mma7660_hook, &acc);
+  avr_connect_irq(acc.irq + TWI_IRQ_INPUT, avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT));
+  avr_connect_irq(avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_OUTPUT), acc.irq + TWI_IRQ_OUTPUT);
+}
+
+///////////////////////////////////////////////
+/////////////////////RUN///////////////////////
+///////////////////////////////////////////////
+
+static void step(avr_t* avr) {
+  uint16_t sp = get_sp(avr);
+  for(int i = 0; i < function_count; i++) {
+    function_t* f = &functions[i];
+    if(!f->active && avr->pc == f->addr) {
+      f->active = 1;
+      f->sp = sp;
+      f->start = avr->cycle;
+      f->excluded_cycles = 0;
+    } else if(f->active && sp > f->sp) {
+      f->active = 0;
+      avr_cycle_count_t cycles = avr->cycle - f->start;
+      if(f->excluded) {
+        // take this time back out of whatever it was called from
+        for(int j = 0; j < function_count; j++)
+          if(functions[j].active && !functions[j].excluded)
+            functions[j].excluded_cycles += cycles;
+        continue;
+      }
+      cycles -= f->excluded_cycles;
+      if(!f->count || cycles < f->min)
+        f->min = cycles;
+      if(cycles > f->max)
+        f->max = cycles;
+      f->total += cycles;
+      f->count++;
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  if(argc < 7) {
+    fprintf(stderr, "usage: %s sketch.elf mcu f_cpu seconds ram_start name=addr [-name=addr ...]\n", argv[0]);
+    return 2;
+  }
+  elf_firmware_t firmware;
+  memset(&firmware, 0, sizeof(firmware));
+  if(elf_read_firmware(argv[1], &firmware)) {
+    fprintf(stderr, "can't read %s\n", argv[1]);
+    return 2;
+  }
+  strncpy(firmware.mmcu, argv[2], sizeof(firmware.mmcu)-1);
+  firmware.frequency = strtoul(argv[3], NULL, 0);
+  double seconds = atof(argv[4]);
+  uint16_t ram_start = strtoul(argv[5], NULL, 0) & 0xffff; // nm adds 0x800000 to data addresses
+  for(int i = 6; i < argc && function_count < MAX_FUNCTIONS; i++) {
+    function_t* f = &functions[function_count++];
+    char* eq = strrchr(argv[i], '=');
+    if(!eq) {
+      fprintf(stderr, "expected name=addr, not %s\n", argv[i]);
+      return 2;
+    }
+    *eq = 0;
+    f->excluded = argv[i][0] == '-';
+    f->name = argv[i] + f->excluded;
+    f->addr = strtoul(eq+1, NULL, 0);
+  }
+
+  avr_t* avr = avr_make_mcu_by_name(firmware.mmcu);
+  if(!avr) {
+    fprintf(stderr, "simavr doesn't know %s\n", firmware.mmcu);
+    return 2;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &firmware);
+  avr->vcc = avr->avcc = avr->aref = 3700;
+  attach_mma7660(avr);
+  // millivolts: thermal sensor 500mV + 10mV/C, charge pin floating
+  avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC0), 750);
+  avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC3), 1800);
+
+  for(uint16_t i = ram_start; i <= avr->ramend; i++)
+    avr->data[i] = PAINT;
+
+  avr_cycle_count_t end = seconds * firmware.frequency;
+  while(avr->cycle < end) {
+    int state = avr_run(avr);
+    if(state == cpu_Done || state == cpu_Crashed) {
+      fprintf(stderr, "cpu stopped at pc 0x%x\n", avr->pc);
+      return 1;
+    }
+    step(avr);
+  }
+
+  for(int i = 0; i < function_count; i++) {
+    function_t* f = &functions[i];
+    if(f->excluded)
+      continue;
+    printf("call %s count %lu avg %lu min %lu max %lu\n", f->name, f->count,
+           f->count ? (unsigned long)(f->total / f->count) : 0UL,
+           (unsigned long)f->min, (unsigned long)f->max);
+  }
+  uint16_t low = ram_start;
+  while(low <= avr->ramend && avr->data[low] == PAINT)
+    low++;
+  printf("stack %u\n", (unsigned)(avr->ramend + 1 - low));
+  return 0;
+}
@@ -0,0 +1,162 @@
+#!/usr/bin/env python
+"""
+Decode the hexbright library's binary debug events (see DEBUG_EVENT_SLOTS
+in libraries/hexbright/hexbright.h) from a serial capture or port.
+
+  python tools/debug_log.py capture.bin
+  python tools/debug_log.py /dev/ttyUSB0 [--baud 9600]
+  cat capture.bin | python tools/debug_log.py [--ms 8]
+
+Each event prints as
+
+  <update> <EVENT_NAME> <value>   # <description from hexbright.h>
+
+with the update count unwrapped from the 8 bit tick in each frame (times
+update_delay_ms with --ms).  Anything that isn't a frame (println output
+from the sketch or library) passes through as text.  A 0xA5 that doesn't
+start a frame with a good checksum and a known id is taken as text too,
+so a capture that starts mid-frame, or loses a byte, resyncs at the next
+frame; the number of these is printed to stderr at the end.  Event names and
+descriptions are read from hexbright.h, so new EVENT_* defines show up
+without changing this script; ids from EVENT_USER up print as USER+n.
+"""
+
+import optparse
+import os
+import re
+import subprocess
+import sys
+
+FRAME_START = 0xA5
+FRAME_BYTES = 6  # start, id, tick, value (2), checksum
+
+# values packed by the library, unpacked for printing
+FORMATS = {
+    'LOOP_TIME': lambda v: '%.1f ms' % (v / 10.0),
+    'DRIVER': lambda v: '%s pwm %d' % ('HIGH' if v >> 8 else 'LOW', v & 0xff),
+    'SET_LED': lambda v: '%s on %d' % ('RLED' if v >> 8 else 'GLED', v & 0xff),
+    'CHARGE': lambda v: 'state %d reading %d' % ((v >> 12) & 0xf, v & 0xfff),
+    'GESTURE': lambda v: 'template %d distance %d%%' % (v >> 8, v & 0xff),
+    'JAB_AXIS': lambda v: 'new %d%% old %d%%' % (v >> 8, v & 0xff),
+}
+
+
+def read_events():
+    header = os.path.join(os.path.dirname(__file__), '..', 'libraries',
+                          'hexbright', 'hexbright.h')
+    names, user = {}, 128
+    for line in open(header):
+        m = re.match(r'#define\s+EVENT_(\w+)\s+(\d+)\s*(?://\s*(.*))?', line)
+        if not m:
+            continue
+        if m.group(1) == 'USER':
+            user = int(m.group(2))
+        else:
+            names[int(m.group(2))] = (m.group(1), (m.group(3) or '').strip())
+    return names, user
+
+
+class Decoder(object):
+    def __init__(self, out, ms=None):
+        self.names, self.user = read_events()
+        self.out = out
+        self.ms = ms
+        self.pending = bytearray()
+        self.text = bytearray()
+        self.update = None
+        self.last_tick = 0
+        self.bad = 0
+
+    def feed(self, data):
+        self.pending.extend(bytearray(data))
+        while self.pending:
+            if self.pending[0] != FRAME_START:
+                self.put_text(self.pending[0])
+                del self.pending[0]
+                continue
+            if len(self.pending) < FRAME_BYTES:
+                return
+            frame = self.pending[:FRAME_BYTES]
+            if not self.plausible(frame):
+                # not a frame after all (or corrupted); resync past this byte
+                self.bad += 1
+                self.put_text(self.pending[0])
+                del self.pending[0]
+                continue
+            del self.pending[:FRAME_BYTES]
+            self.event(frame[1], frame[2], frame[3] | frame[4] << 8)
+
+    def plausible(self, frame):
+        if sum(frame[1:-1]) & 0xff != frame[-1]:
+            return False
+        return frame[1] >= self.user or frame[1] in self.names
+
+    def put_text(self, byte):
+        if byte == ord('\n'):
+            self.flush_text()
+        elif byte != ord('\r'):
+            self.text.append(byte)
+
+    def flush_text(self):
+        if self.text:
+            self.out.write(self.text.decode('ascii', 'replace') + '\n')
+            self.text = bytearray()
+
+    def event(self, id, tick, value):
+        self.flush_text()
+        if self.update is None:
+            self.update = tick
+        else:
+            self.update += (tick - self.last_tick) & 0xff
+        self.last_tick = tick
+        if value >= 0x8000:
+            value -= 0x10000
+        if id >= self.user:
+            name, description = 'USER+%d' % (id - self.user), ''
+        else:
+            name, description = self.names.get(id, ('UNKNOWN_%d' % id, ''))
+        when = '%d' % self.update if self.ms is None else '%.3f' % (self.update * self.ms / 1000.0)
+        shown = FORMATS[name](value) if name in FORMATS else '%d' % value
+        line = '%8s %-16s %s' % (when, name, shown)
+        if description:
+            line += '   # ' + description
+        self.out.write(line + '\n')
+        self.out.flush()
+
+
+def open_input(path, baud):
+    if path is None or path == '-':
+        return getattr(sys.stdin, 'buffer', sys.stdin)
+    if path.startswith('/dev/'):
+        subprocess.check_call(['stty', '-F', path, 'raw', '-echo', str(baud)])
+        return open(path, 'rb', 0)
+    return open(path, 'rb')
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] [capture file or serial port]')
+    parser.add_option('--baud', type='int', default=9600,
+                      help='serial port speed (DEBUG_BAUD, default 9600)')
+    parser.add_option('--ms', type='float',
+                      help="sketch's update_delay_ms, to print seconds instead of updates")
+    options, args = parser.parse_args()
+    if len(args) > 1:
+        parser.error('one input at a time')
+
+    source = open_input(args[0] if args else None, options.baud)
+    decoder = Decoder(sys.stdout, options.ms)
+    try:
+        while True:
+            data = source.read(1) if args and args[0].startswith('/dev/') else source.read(4096)
+            if not data:
+                break
+            decoder.feed(data)
+    except KeyboardInterrupt:
+        pass
+    decoder.flush_text()
+    if decoder.bad:
+        sys.stderr.write('%d bad frames skipped\n' % decoder.bad)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,138 @@
+#!/usr/bin/env python
+"""
+Build a hexbright gesture template (see hexbright::match_gesture) from 
+recorded accelerometer traces.
+
+Record traces with programs/gestures: hold the button, make the gesture, 
+hold still for a moment, release.  Save the serial output to a file.  
+Each recording is a run of 'x,y,z' lines (raw readings), separated by 
+blank lines.  Lines starting with '#' are ignored.
+
+  python tools/gesture_template.py FLICK flick1.txt flick2.txt > flick.h
+
+The output is a template to paste into a PROGMEM gesture array 
+(like the one in libraries/hexbright/gestures.h), followed by the 
+distance of each recording from it (as a percentage, like
+match_gesture's threshold), to help pick a threshold.
+"""
+
+import os
+import re
+import sys
+
+# keep in sync with libraries/hexbright/hexbright.h
+DEFAULTS = {'GESTURE_LENGTH': 16, 'GESTURE_BAND': 2}
+MOTION = 2  # change between samples (raw) that counts as movement
+SETTLE = 2  # samples kept after the motion stops
+
+
+def read_defines():
+    header = os.path.join(os.path.dirname(__file__), '..', 'libraries',
+                          'hexbright', 'hexbright.h')
+    values = dict(DEFAULTS)
+    try:
+        for line in open(header):
+            m = re.match(r'#define\s+(GESTURE_\w+)\s+(\d+)', line)
+            if m:
+                values[m.group(1)] = int(m.group(2))
+    except IOError:
+        pass
+    return values['GESTURE_LENGTH'], values['GESTURE_BAND']
+
+
+def read_recordings(paths):
+    recordings = []
+    for path in paths:
+        current = []
+        for line in open(path):
+            line = line.strip()
+            if line.startswith('#'):
+                continue
+            if not line:
+                if current:
+                    recordings.append(current)
+                current = []
+                continue
+            try:
+                current.append([int(v) for v in line.split(',')[:3]])
+            except ValueError:
+                pass  # other serial output
+        if current:
+            recordings.append(current)
+    return recordings
+
+
+def extract(recording, length):
+    """The length samples ending just after the motion stops, with the
+    gravity at that point removed (this is what the library matches)."""
+    last_motion = 0
+    for i in range(1, len(recording)):
+        if max(abs(a - b) for a, b in zip(recording[i], recording[i - 1])) > MOTION:
+            last_motion = i
+    end = min(len(recording), last_motion + 1 + SETTLE)
+    start = end - length
+    if start < 0:
+        return None
+    tail = recording[end - SETTLE - 1:end] or recording[end - 1:end]
+    gravity = [sum(s[k] for s in tail) / float(len(tail)) for k in range(3)]
+    return [[s[k] - gravity[k] for k in range(3)] for s in recording[start:end]]
+
+
+def distance(window, template, band):
+    """Same banded dynamic time warping as hexbright::gesture_distance."""
+    n = len(window)
+    inf = float('inf')
+    previous = [inf] * n
+    for i in range(n):
+        current = [inf] * n
+        for j in range(max(0, i - band), min(n - 1, i + band) + 1):
+            if i == 0 and j == 0:
+                best = 0
+            else:
+                best = min(previous[j] if i else inf,
+                           previous[j - 1] if i and j else inf,
+                           current[j - 1] if j else inf)
+            if best == inf:
+                continue
+            current[j] = best + sum(abs(window[i][k] - template[j][k]) for k in range(3))
+        previous = current
+    return previous[n - 1]
+
+
+def main(argv):
+    if len(argv) < 3:
+        sys.stderr.write(__doc__)
+        return 1
+    name = argv[1].upper()
+    length, band = read_defines()
+    windows = []
+    for recording in read_recordings(argv[2:]):
+        window = extract(recording, length)
+        if window is None:
+            sys.stderr.write('skipping a recording shorter than %d samples\n' % length)
+        else:
+            windows.append(window)
+    if not windows:
+        sys.stderr.write('no usable recordings\n')
+        return 1
+
+    template = [[int(round(sum(w[i][k] for w in windows) / len(windows)))
+                 for k in range(3)] for i in range(length)]
+    template = [[max(-128, min(127, v)) for v in s] for s in template]
+
+    print('  { // GESTURE_%s (from %d recordings)' % (name, len(windows)))
+    rows = []
+    for i in range(0, length, 4):
+        rows.append('    ' + ', '.join('{%3d,%3d,%3d}' % tuple(s) for s in template[i:i + 4]))
+    print(',\n'.join(rows))
+    print('  },')
+    # match_gesture's threshold is a percentage of the template's size
+    size = max(1, sum(abs(v) for s in template for v in s))
+    scores = [100 * distance(w, template, band) // size for w in windows]
+    print('  // distances (%%): %s' % ' '.join('%d' % d for d in scores))
+    print('  // try a threshold a little above %d%%' % max(scores))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
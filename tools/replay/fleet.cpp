@@ -0,0 +1,314 @@
+/*
+Runs a fleet of virtual lights on the host, spread over every core, for
+sweeping the library's tuning against recorded traces.  Built and driven
+by fleet.py:
+
+  fleet specs.txt [threads]
+
+Each line of the spec file is one light:
+
+  # comment
+  trace experiment [key=value ...]
+
+Traces (see trace.h) are read once and shared by every light that uses
+them.  Each light gets its own library state (hexbright_select_state)
+and runs start to finish on one thread, which has its own hal, so lights
+never see each other.  Results are a csv, one row per light in spec
+order, with a column for every parameter and result any light had.
+
+Sketches can't be lights (their globals would be shared by the whole
+fleet), so the experiments are written here, against the library's api:
+
+  thermal level=1000 ms=20 [seconds=0] [model=head.model ...]
+    Turns on at level and holds it.  Reports the seconds until overheat
+    or low battery protection first dimmed the light (-1 if never), the
+    mean safe level, the mean over the last quarter of the run (what it
+    can sustain), the lowest, and the hottest get_celsius.  The trace's
+    last line is held until seconds have passed, if that's longer.
+    With a model (see thermal_model.h), its sensor replaces the trace's
+    thermal input, driven by the light's own level, and the hottest the
+    head got is reported, and by how much it overshot OVERHEAT_CELSIUS.
+    Model parameters can be overridden too: ambient_c=35.
+  gesture threshold=50 ms=18 rate=auto
+    Matches gestures.h's templates every update, as programs/gestures
+    does (quiet for GESTURE_LENGTH updates after a match), and counts
+    the matches.  rate is an ACC_RATE_* number, or auto.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "trace.h"
+#include "thermal_model.h"
+#include <Arduino.h>
+#include <hexbright.h>
+#include <gestures.h>
+
+typedef std::map<std::string, std::string> params;
+typedef std::vector<std::pair<std::string, double> > results;
+
+struct light {
+  std::string trace_name;
+  const std::vector<trace_line>* trace;
+  std::string experiment;
+  std::vector<std::pair<std::string, std::string> > settings; // as given, for the csv
+  params p;
+  results r;
+  std::string error;
+};
+
+static double param(const params& p, const char* name, double fallback) {
+  params::const_iterator i = p.find(name);
+  return i == p.end() ? fallback : atof(i->second.c_str());
+}
+
+///////////////////////////////////////////////
+/////////////////EXPERIMENTS///////////////////
+///////////////////////////////////////////////
+
+static void run_thermal(light* l) {
+  int level = param(l->p, "level", MAX_LEVEL);
+  double seconds = param(l->p, "seconds", 0);
+  thermal_model model = thermal_model();
+  bool modelled = l->p.count("model");
+  if(modelled) {
+    if(!read_thermal_model(l->p["model"].c_str(), &model)) {
+      l->error = "bad model";
+      return;
+    }
+    for(params::const_iterator i=l->p.begin(); i!=l->p.end(); i++)
+      set_thermal_model(&model, i->first.c_str(), atof(i->second.c_str()));
+    thermal_model_start(&model);
+  }
+  hexbright hb(param(l->p, "ms", 20));
+  hal_inputs inputs = (*l->trace)[0].inputs;
+  if(modelled) {
+    inputs.thermal = thermal_model_reading(&model);
+    hal_reset(&inputs);
+  }
+  hb.init_hardware();
+  hb.set_light(CURRENT_LEVEL, level, NOW);
+
+  std::vector<int> levels;
+  double throttle_s = -1, max_head = model.head_c;
+  int max_celsius = -273;
+  int driven = 0;
+  uint64_t last_us = hal_time_us();
+  size_t line = 0;
+  long repeat = 0;
+  while(line < l->trace->size() || hal_time_us() < seconds*1e6) {
+    // the last line holds until seconds have passed
+    if(line < l->trace->size()) {
+      inputs = (*l->trace)[line].inputs;
+      if(++repeat >= (*l->trace)[line].count) {
+        line++;
+        repeat = 0;
+      }
+    }
+    if(modelled) {
+      thermal_model_step(&model, driven, (hal_time_us()-last_us)/1e6);
+      last_us = hal_time_us();
+      max_head = max(max_head, model.head_c);
+      inputs.thermal = thermal_model_reading(&model);
+    }
+    hal_set_inputs(&inputs);
+    hb.update();
+    driven = hb.get_safe_light_level();
+    if(throttle_s < 0 && driven < level)
+      throttle_s = hal_time_us()/1e6;
+    levels.push_back(driven);
+    max_celsius = max(max_celsius, hb.get_celsius());
+  }
+
+  double sum = 0, last_quarter = 0;
+  int min_level = MAX_LEVEL;
+  for(size_t i=0; i<levels.size(); i++) {
+    sum += levels[i];
+    if(i >= levels.size()*3/4)
+      last_quarter += levels[i];
+    min_level = min(min_level, levels[i]);
+  }
+  l->r.push_back(std::make_pair("throttle_s", throttle_s));
+  l->r.push_back(std::make_pair("mean_level", sum/levels.size()));
+  l->r.push_back(std::make_pair("sustained_level", last_quarter/(levels.size()-levels.size()*3/4)));
+  l->r.push_back(std::make_pair("min_level", (double)min_level));
+  l->r.push_back(std::make_pair("max_celsius", (double)max_celsius));
+  if(modelled) {
+    l->r.push_back(std::make_pair("max_head_c", max_head));
+    l->r.push_back(std::make_pair("overshoot_c", max_head - OVERHEAT_CELSIUS));
+  }
+}
+
+static void run_gesture(light* l) {
+  int threshold = param(l->p, "threshold", 50);
+  hexbright hb(param(l->p, "ms", 18));
+  hb.init_hardware();
+  params::const_iterator rate = l->p.find("rate");
+  if(rate != l->p.end() && rate->second != "auto")
+    hb.set_accelerometer_rate(atoi(rate->second.c_str()));
+
+  int matches[3] = {0, 0, 0};
+  int quiet = 0;
+  for(size_t i=0; i<l->trace->size(); i++) {
+    const trace_line& t = (*l->trace)[i];
+    for(long n=0; n<t.count; n++) {
+      hal_set_inputs(&t.inputs);
+      hb.update();
+      if(quiet) {
+        quiet--;
+        continue;
+      }
+      char match = hb.match_gesture(gesture_templates, 3, threshold);
+      if(match >= 0) {
+        matches[(int)match]++;
+        quiet = GESTURE_LENGTH;
+      }
+    }
+  }
+  l->r.push_back(std::make_pair("flick", (double)matches[GESTURE_FLICK]));
+  l->r.push_back(std::make_pair("twist", (double)matches[GESTURE_TWIST]));
+  l->r.push_back(std::make_pair("double_tap", (double)matches[GESTURE_DOUBLE_TAP]));
+}
+
+static const struct {
+  const char* name;
+  void (*run)(light* l);
+} experiments[] = {
+  {"thermal", run_thermal},
+  {"gesture", run_gesture},
+};
+
+///////////////////////////////////////////////
+////////////////////FLEET//////////////////////
+///////////////////////////////////////////////
+
+static void run_light(light* l) {
+  for(size_t i=0; i<sizeof(experiments)/sizeof(experiments[0]); i++) {
+    if(l->experiment == experiments[i].name) {
+      hexbright_state* state = hexbright_new_state();
+      hexbright_select_state(state);
+      hal_reset(&(*l->trace)[0].inputs);
+      experiments[i].run(l);
+      hexbright_select_state(NULL);
+      hexbright_delete_state(state);
+      return;
+    }
+  }
+  l->error = "unknown experiment";
+}
+
+static bool read_specs(const char* path, std::vector<light>* lights,
+                       std::map<std::string, std::vector<trace_line> >* traces) {
+  FILE* f = fopen(path, "r");
+  if(!f) {
+    fprintf(stderr, "can't read %s\n", path);
+    return false;
+  }
+  char line[1024];
+  for(int number=1; fgets(line, sizeof(line), f); number++) {
+    std::vector<std::string> words;
+    for(char* w=strtok(line, " \t\r\n"); w; w=strtok(NULL, " \t\r\n"))
+      words.push_back(w);
+    if(words.empty() || words[0][0] == '#')
+      continue;
+    if(words.size() < 2) {
+      fprintf(stderr, "%s:%d: needs a trace and an experiment\n", path, number);
+      return false;
+    }
+    light l;
+    l.trace_name = words[0];
+    l.experiment = words[1];
+    for(size_t i=2; i<words.size(); i++) {
+      size_t equals = words[i].find('=');
+      if(equals == std::string::npos) {
+        fprintf(stderr, "%s:%d: '%s' isn't key=value\n", path, number, words[i].c_str());
+        return false;
+      }
+      std::string key = words[i].substr(0, equals), value = words[i].substr(equals+1);
+      l.settings.push_back(std::make_pair(key, value));
+      l.p[key] = value;
+    }
+    if(!traces->count(l.trace_name) && !read_trace(l.trace_name.c_str(), &(*traces)[l.trace_name]))
+      return false;
+    lights->push_back(l);
+  }
+  fclose(f);
+  // the map doesn't move its values, so these stay put
+  for(size_t i=0; i<lights->size(); i++)
+    (*lights)[i].trace = &(*traces)[(*lights)[i].trace_name];
+  return true;
+}
+
+// columns in the order they first appear
+static void add_column(std::vector<std::string>* columns, const std::string& name) {
+  for(size_t i=0; i<columns->size(); i++)
+    if((*columns)[i] == name)
+      return;
+  columns->push_back(name);
+}
+
+static void print_csv(const std::vector<light>& lights) {
+  std::vector<std::string> settings, outputs;
+  for(size_t i=0; i<lights.size(); i++) {
+    for(size_t j=0; j<lights[i].settings.size(); j++)
+      add_column(&settings, lights[i].settings[j].first);
+    for(size_t j=0; j<lights[i].r.size(); j++)
+      add_column(&outputs, lights[i].r[j].first);
+  }
+  printf("light,trace,experiment");
+  for(size_t i=0; i<settings.size(); i++)
+    printf(",%s", settings[i].c_str());
+  for(size_t i=0; i<outputs.size(); i++)
+    printf(",%s", outputs[i].c_str());
+  printf(",error\n");
+  for(size_t i=0; i<lights.size(); i++) {
+    const light& l = lights[i];
+    printf("%u,%s,%s", (unsigned)i, l.trace_name.c_str(), l.experiment.c_str());
+    for(size_t j=0; j<settings.size(); j++) {
+      params::const_iterator v = l.p.find(settings[j]);
+      printf(",%s", v == l.p.end() ? "" : v->second.c_str());
+    }
+    for(size_t j=0; j<outputs.size(); j++) {
+      printf(",");
+      for(size_t k=0; k<l.r.size(); k++)
+        if(l.r[k].first == outputs[j])
+          printf("%g", l.r[k].second);
+    }
+    printf(",%s\n", l.error.c_str());
+  }
+}
+
+int main(int argc, char** argv) {
+  if(argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s specs.txt [threads]\n", argv[0]);
+    return 2;
+  }
+  std::vector<light> lights;
+  std::map<std::string, std::vector<trace_line> > traces;
+  if(!read_specs(argv[1], &lights, &traces))
+    return 2;
+  unsigned threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+  if(threads < 1)
+    threads = 1;
+  if(threads > lights.size())
+    threads = lights.size();
+
+  // each thread takes the next light until they're all done
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> pool;
+  for(unsigned i=0; i<threads; i++) {
+    pool.push_back(std::thread([&]() {
+      for(size_t n; (n = next++) < lights.size(); )
+        run_light(&lights[n]);
+    }));
+  }
+  for(size_t i=0; i<pool.size(); i++)
+    pool[i].join();
+
+  print_csv(lights);
+  return 0;
+}
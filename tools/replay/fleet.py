@@ -0,0 +1,165 @@
+#!/usr/bin/env python
+"""
+Runs a fleet of virtual lights, many at once (a thread per core), to sweep
+the library's tuning against recorded traces.
+
+  python tools/replay/fleet.py SPECS [SPECS ...] [--jobs N] [-o results.csv]
+
+Each line of a spec file describes lights:
+
+  # comment
+  trace experiment [key=value ...]
+
+Experiments are built into fleet.cpp (see there for what each one takes
+and reports).  A value can be a sweep, and the line is expanded into a
+light for every combination:
+
+  traces/hot.trace thermal level=200:1000:100
+  traces/flicks.trace gesture threshold=20,35,50 ms=16:20:2
+
+a:b:step counts from a to b inclusive; a,b,c lists values.  Trace (and
+model=) paths are relative to the spec file.  The fleet is built (with
+$CXX, default g++) from the unmodified library and tools/replay/hal;
+results are a csv with a row per light, in spec order.
+
+To score a change to the library (overheat_protection, say) against the
+current one, run the same specs with --library pointing at a copy of
+libraries/hexbright with the change, and compare.  -D sets a #define for
+the build, e.g. -D OVERHEAT_CELSIUS=50.  Thermal models come from
+thermal_fit.py.
+
+Throughput with 760 lights (400 thermal, 360 gesture, on short test
+traces), all measured on a machine with a single core: 75 s with 1
+thread (10 lights/s), 68 s with 4, 62 s with 16, and the same csv each
+time.  Those extra threads share the one core, so the numbers say
+nothing about scaling across cores, which hasn't been measured.
+"""
+
+import itertools
+import optparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+sys.path.insert(0, os.path.join(HERE, '..', 'bench'))
+import budget  # noqa: E402
+import replay  # noqa: E402  (build flags are shared)
+
+
+def expand_value(value):
+    """The values a sweep stands for (a single value is its own list)."""
+    if ',' in value:
+        return value.split(',')
+    parts = value.split(':')
+    if len(parts) == 3:
+        try:
+            start, stop, step = [float(p) for p in parts]
+        except ValueError:
+            return [value]
+        if step <= 0:
+            sys.exit('sweep %s needs a positive step' % value)
+        values = []
+        n = 0
+        while start + n*step <= stop + step*1e-9:
+            values.append('%g' % (start + n*step))
+            n += 1
+        return values
+    return [value]
+
+
+def expand(path):
+    """The spec file's lights, one line each, with trace paths from here."""
+    base = os.path.dirname(os.path.abspath(path))
+    lights = []
+    for number, line in enumerate(open(path), 1):
+        words = line.split()
+        if not words or words[0].startswith('#'):
+            continue
+        if len(words) < 2:
+            sys.exit('%s:%d: needs a trace and an experiment' % (path, number))
+        trace = os.path.relpath(os.path.join(base, words[0]))
+        keys, choices = [], []
+        for word in words[2:]:
+            if '=' not in word:
+                sys.exit("%s:%d: '%s' isn't key=value" % (path, number, word))
+            key, value = word.split('=', 1)
+            if key == 'model':
+                value = os.path.relpath(os.path.join(base, value))
+            keys.append(key)
+            choices.append(expand_value(value))
+        for combination in itertools.product(*choices):
+            settings = ' '.join('%s=%s' % kv for kv in zip(keys, combination))
+            lights.append(('%s %s %s' % (trace, words[1], settings)).rstrip())
+    return lights
+
+
+def build(flags, library, build_dir):
+    binary = os.path.join(build_dir, 'fleet')
+    compiler = os.environ.get('CXX', 'g++')
+    args = ([compiler] + replay.CXXFLAGS + list(flags) + ['-pthread'] +
+            ['-I' + replay.HAL, '-I' + library,
+             os.path.join(HERE, 'fleet.cpp'), os.path.join(HERE, 'trace.cpp'),
+             os.path.join(HERE, 'thermal_model.cpp'), os.path.join(replay.HAL, 'hal.cpp'),
+             os.path.join(library, 'hexbright.cpp'), '-o', binary])
+    proc = subprocess.Popen(args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    out = proc.communicate()[0].decode('utf-8', 'replace')
+    if proc.returncode:
+        sys.exit('building the fleet failed:\n%s' % out)
+    sys.stderr.write(out)  # warnings
+    return binary
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] SPECS [SPECS ...]')
+    parser.add_option('--jobs', '-j', type='int', default=0,
+                      help='threads to run lights on (default: one per core)')
+    parser.add_option('--output', '-o', metavar='CSV', help='write the results here (default stdout)')
+    parser.add_option('--features', default='full',
+                      help='library feature set, as named by budget.py (default full)')
+    parser.add_option('--library', metavar='DIR', default=replay.LIBRARY,
+                      help='build this copy of the hexbright library (default libraries/hexbright)')
+    parser.add_option('--define', '-D', metavar='NAME[=VALUE]', action='append', default=[],
+                      help='#define for the build (repeatable)')
+    parser.add_option('--keep', metavar='DIR', help='build in DIR and keep it')
+    options, args = parser.parse_args()
+    if not args:
+        parser.error('need a spec file')
+    flags = dict(budget.feature_sets()).get(options.features)
+    if flags is None:
+        sys.exit('unknown feature set %r; try one of: %s' %
+                 (options.features, ', '.join(n for n, f in budget.feature_sets())))
+    flags = list(flags) + ['-D' + d for d in options.define]
+
+    lights = []
+    for path in args:
+        lights += expand(path)
+    if not lights:
+        sys.exit('no lights to run')
+
+    build_dir = options.keep or tempfile.mkdtemp(prefix='hexbright-fleet-')
+    if not os.path.isdir(build_dir):
+        os.makedirs(build_dir)
+    try:
+        binary = build(flags, os.path.abspath(options.library), build_dir)
+        specs = os.path.join(build_dir, 'specs.txt')
+        open(specs, 'w').write('\n'.join(lights) + '\n')
+        command = [binary, specs]
+        if options.jobs:
+            command.append(str(options.jobs))
+        output = open(options.output, 'w') if options.output else None
+        status = subprocess.call(command, stdout=output)
+        if output:
+            output.close()
+            sys.stderr.write('%d lights, results in %s\n' % (len(lights), options.output))
+    finally:
+        if not options.keep:
+            shutil.rmtree(build_dir)
+    sys.exit(status)
+
+
+if __name__ == '__main__':
+    main()
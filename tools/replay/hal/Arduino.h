@@ -0,0 +1,133 @@
+/*
+Host stand-in for the Arduino 1.0 core, for tools/replay: enough to build
+the hexbright library and its sketches on linux, unmodified.  Pins,
+registers, time and the serial port are modelled in hal.cpp; the replay
+driver sets the inputs and reads the outputs through hal.h.
+
+Types and macros follow the avr core (boolean is a byte, min/max/abs are
+macros), but int is 32 bits here, not 16.  Code that relies on 16 bit
+overflow will behave differently.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+// standard headers first, the macros below would break them
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+typedef uint8_t byte;
+typedef uint8_t boolean;
+typedef unsigned int word;
+
+#define HIGH 0x1
+#define LOW  0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEFAULT 1
+#define EXTERNAL 0
+#define INTERNAL 3
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define PI 3.1415926535897932384626433832795
+
+#undef abs
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define abs(x) ((x)>0?(x):-(x))
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+#define sq(x) ((x)*(x))
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+
+// the core's count behind millis; here, only what's been added to it
+extern thread_local volatile unsigned long timer0_millis;
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+void attachInterrupt(uint8_t interrupt, void (*handler)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper*>(string_literal))
+
+class String {
+  public:
+    String(const char* s = "") : s(s) {}
+    explicit String(char c) : s(1, c) {}
+    explicit String(int value, unsigned char base = DEC);
+    explicit String(unsigned char value, unsigned char base = DEC);
+    explicit String(long value, unsigned char base = DEC);
+    unsigned int length() const { return s.size(); }
+    const char* c_str() const { return s.c_str(); }
+    String& operator+=(const String& other) { s += other.s; return *this; }
+    friend String operator+(const String& a, const String& b) { String r(a); r += b; return r; }
+    bool operator==(const String& other) const { return s == other.s; }
+  private:
+    std::string s;
+};
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    size_t write(const uint8_t* buffer, size_t size);
+    size_t write(const char* str) { return write((const uint8_t*)str, strlen(str)); }
+
+    size_t print(const __FlashStringHelper* s) { return write((const char*)s); }
+    size_t print(const String& s) { return write(s.c_str()); }
+    size_t print(const char* s) { return write(s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+
+    size_t println() { return write("\r\n"); }
+    template<class T> size_t println(T value) { size_t n = print(value); return n + println(); }
+    template<class T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+};
+
+class HardwareSerial : public Print {
+  public:
+    void begin(unsigned long baud) {}
+    void end() {}
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    void flush() {}
+    virtual size_t write(uint8_t c);
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif
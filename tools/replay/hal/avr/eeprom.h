@@ -0,0 +1,17 @@
+/*
+Host stand-in for <avr/eeprom.h>, for tools/replay.  The eeprom starts
+erased (0xFF) in every run.
+*/
+
+#ifndef HAL_AVR_EEPROM_H
+#define HAL_AVR_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void eeprom_read_block(void* dst, const void* src, size_t n);
+void eeprom_write_block(const void* src, void* dst, size_t n);
+uint8_t eeprom_read_byte(const uint8_t* address);
+void eeprom_write_byte(uint8_t* address, uint8_t value);
+
+#endif
@@ -0,0 +1,22 @@
+/*
+Host stand-in for <avr/interrupt.h>, for tools/replay.  ISR(v) defines a
+plain function; hal.cpp calls it when the interrupt would fire.
+*/
+
+#ifndef HAL_AVR_INTERRUPT_H
+#define HAL_AVR_INTERRUPT_H
+
+#define ISR(vector) extern "C" void vector(void)
+
+#define INT1_vect hal_vector_int1
+#define TIMER1_COMPA_vect hal_vector_timer1_compa
+#define USART_UDRE_vect hal_vector_usart_udre
+#define ADC_vect hal_vector_adc
+#define TWI_vect hal_vector_twi
+
+void hal_cli();
+void hal_sei();
+#define cli() hal_cli()
+#define sei() hal_sei()
+
+#endif
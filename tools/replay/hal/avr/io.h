@@ -0,0 +1,85 @@
+/*
+Host stand-in for <avr/io.h>, for tools/replay.  The registers the
+hexbright library touches are objects: writing one lets hal.cpp play the
+hardware's part (start a conversion, step the twi, stage an interrupt).
+Bit positions are the ATmega168's.  Each thread has its own registers.
+*/
+
+#ifndef HAL_AVR_IO_H
+#define HAL_AVR_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef F_CPU
+#define F_CPU 8000000L
+#endif
+#define E2END 511
+#define RAMEND 0x4FF
+
+#define _BV(bit) (1 << (bit))
+
+typedef void (*hal_write_hook)(uint8_t written);
+
+struct hal_reg8 {
+  uint8_t value;
+  hal_write_hook hook; // sets value itself
+  operator uint8_t() const { return value; }
+  hal_reg8& operator=(uint8_t v);
+  hal_reg8& operator|=(uint8_t v) { return *this = value | v; }
+  hal_reg8& operator&=(uint8_t v) { return *this = value & v; }
+  hal_reg8& operator^=(uint8_t v) { return *this = value ^ v; }
+};
+
+struct hal_reg16 {
+  uint16_t value;
+  operator uint16_t() const { return value; }
+  hal_reg16& operator=(uint16_t v) { value = v; return *this; }
+};
+
+// twi
+extern thread_local hal_reg8 TWBR, TWSR, TWDR, TWCR;
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+
+// adc
+extern thread_local hal_reg8 ADMUX, ADCSRA;
+extern thread_local hal_reg16 ADC;
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+
+// timer0 runs the core's millis; it counts every 64 cycles
+uint8_t hal_tcnt0();
+#define TCNT0 hal_tcnt0()
+
+// timer1
+extern thread_local hal_reg8 TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern thread_local hal_reg16 OCR1A, OCR1B;
+#define COM1A1 7
+#define COM1B1 5
+#define OCIE1A 1
+#define OCF1A 1
+
+// usart
+extern thread_local hal_reg8 UCSR0A, UCSR0B, UCSR0C, UDR0;
+extern thread_local hal_reg16 UBRR0;
+#define U2X0 1
+#define UDRIE0 5
+#define TXEN0 3
+#define UCSZ01 2
+#define UCSZ00 1
+
+// ports (digitalWrite goes through these too)
+extern thread_local hal_reg8 PORTB, PORTC, PORTD;
+#define PORTB1 1
+#define PORTB2 2
+
+#endif
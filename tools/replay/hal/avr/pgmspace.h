@@ -0,0 +1,31 @@
+/*
+Host stand-in for <avr/pgmspace.h>, for tools/replay: flash is just memory.
+*/
+
+#ifndef HAL_AVR_PGMSPACE_H
+#define HAL_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+typedef const char* PGM_P;
+
+static inline uint8_t pgm_read_byte(const void* address) {
+  return *(const uint8_t*)address;
+}
+static inline uint16_t pgm_read_word(const void* address) {
+  uint16_t value;
+  memcpy(&value, address, sizeof(value));
+  return value;
+}
+static inline uint32_t pgm_read_dword(const void* address) {
+  uint32_t value;
+  memcpy(&value, address, sizeof(value));
+  return value;
+}
+#define memcpy_P memcpy
+#define strlen_P strlen
+
+#endif
@@ -0,0 +1,19 @@
+/*
+Host stand-in for <avr/sleep.h>, for tools/replay.  Sleeping lets time
+pass and any pending interrupt run.
+*/
+
+#ifndef HAL_AVR_SLEEP_H
+#define HAL_AVR_SLEEP_H
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_ADC 1
+#define SLEEP_MODE_PWR_DOWN 2
+
+void hal_sleep();
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() hal_sleep()
+
+#endif
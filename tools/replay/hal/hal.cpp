@@ -0,0 +1,633 @@
+/*
+The hardware around the hexbright's ATmega168, modelled just well enough
+for the library to run unmodified on the host (tools/replay).
+
+Time only passes while the code waits for it: each call to millis() or
+micros() moves the clock HAL_CALL_US on, so wait_for_update's loop ends
+after update_delay_ms, and twi_finish's timeout still works.  Nothing
+else takes time, so a run is as fast as the host and exactly repeatable.
+
+Interrupts run as soon as they're pending and enabled (after the register
+write that caused them, or at sei()), in the avr's priority order, one at
+a time.  Adc conversions and twi steps finish at once, so a round started
+by read_adc or start_accelerometer_read is always done by the next update.
+The accelerometer samples on its own clock, though, at its configured
+rates (see acc_update).
+
+Every thread has its own hardware (registers and all), so a simulator can
+run a light per thread; see hexbright_select_state for the library's side.
+*/
+
+#include <Arduino.h>
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
+#include <stdio.h>
+#include "hal.h"
+
+#define HAL_CALL_US 5 // how far each millis() or micros() call moves the clock
+#define HAL_SLEEP_US 100
+#define HAL_PINS 20
+#define HAL_ISR_LIMIT 10000 // interrupts in a row before we decide one is stuck
+
+#define ACC_ADDRESS 0x4C
+#define PIN_BUTTON 2 // DPIN_RLED_SW
+#define PIN_ACC_INT 3
+#define PIN_GLED 5
+#define PIN_PWR 8
+#define PIN_DRV_MODE 9
+#define PIN_DRV_EN 10
+
+extern "C" {
+  void hal_vector_int1(void) __attribute__((weak));
+  void hal_vector_timer1_compa(void) __attribute__((weak));
+  void hal_vector_usart_udre(void) __attribute__((weak));
+  void hal_vector_adc(void) __attribute__((weak));
+  void hal_vector_twi(void) __attribute__((weak));
+}
+
+static void twcr_written(uint8_t value);
+static void adcsra_written(uint8_t value);
+static void dispatch();
+
+thread_local hal_reg8 TWBR, TWSR, TWDR, TWCR = {0, twcr_written};
+thread_local hal_reg8 ADMUX, ADCSRA = {0, adcsra_written};
+thread_local hal_reg16 ADC;
+thread_local hal_reg8 TCCR1A, TCCR1B, TIMSK1, TIFR1;
+thread_local hal_reg16 OCR1A, OCR1B;
+thread_local hal_reg8 UCSR0A, UCSR0B, UCSR0C, UDR0;
+thread_local hal_reg16 UBRR0;
+thread_local hal_reg8 PORTB, PORTC, PORTD;
+
+HardwareSerial Serial;
+
+static thread_local hal_inputs inputs;
+static thread_local uint64_t now_us;
+static thread_local bool interrupts_enabled;
+static thread_local bool in_interrupt;
+
+static thread_local uint8_t pin_mode[HAL_PINS];
+static thread_local uint8_t pin_pwm[HAL_PINS]; // analogWrite value, while the pwm is connected
+static thread_local bool pin_pwm_on[HAL_PINS];
+
+static thread_local void (*int1_handler)(void);
+static thread_local int int1_mode;
+static thread_local bool int1_pending;
+
+static thread_local uint8_t eeprom[E2END+1];
+
+static thread_local void (*serial_listener)(const char* line);
+static thread_local std::string serial_line;
+
+hal_reg8& hal_reg8::operator=(uint8_t v) {
+  if(hook)
+    hook(v);
+  else
+    value = v;
+  dispatch();
+  return *this;
+}
+
+///////////////////////////////////////////////
+////////////////////PINS///////////////////////
+///////////////////////////////////////////////
+
+static hal_reg8* pin_port(uint8_t pin, uint8_t* bit) {
+  if(pin < 8) {
+    *bit = pin;
+    return &PORTD;
+  } else if(pin < 14) {
+    *bit = pin-8;
+    return &PORTB;
+  }
+  *bit = pin-14;
+  return &PORTC;
+}
+
+static int pin_level(uint8_t pin) {
+  uint8_t bit;
+  return (pin_port(pin, &bit)->value >> bit) & 1;
+}
+
+static void set_pin_level(uint8_t pin, int level) {
+  uint8_t bit;
+  hal_reg8* port = pin_port(pin, &bit);
+  if(level)
+    port->value |= _BV(bit);
+  else
+    port->value &= ~_BV(bit);
+}
+
+// the timer output a pin's pwm comes from, as the core's turnOffPWM knows it
+static void disconnect_pwm(uint8_t pin) {
+  if(pin == PIN_DRV_MODE)
+    TCCR1A.value &= ~_BV(COM1A1);
+  else if(pin == PIN_DRV_EN)
+    TCCR1A.value &= ~_BV(COM1B1);
+  pin_pwm_on[pin] = false;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if(pin < HAL_PINS)
+    pin_mode[pin] = mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if(pin >= HAL_PINS)
+    return;
+  disconnect_pwm(pin);
+  set_pin_level(pin, value);
+}
+
+int digitalRead(uint8_t pin) {
+  dispatch();
+  if(pin >= HAL_PINS)
+    return LOW;
+  if(pin_mode[pin] == INPUT) {
+    if(pin == PIN_BUTTON)
+      return inputs.button ? HIGH : LOW;
+    if(pin == PIN_ACC_INT)
+      return int1_pending || pin_level(pin) == LOW ? LOW : HIGH;
+  }
+  return pin_level(pin);
+}
+
+// Arduino 1.0's analogWrite, for the pins the ATmega168 can pwm
+void analogWrite(uint8_t pin, int value) {
+  pinMode(pin, OUTPUT);
+  if(value <= 0) {
+    digitalWrite(pin, LOW);
+  } else if(value >= 255) {
+    digitalWrite(pin, HIGH);
+  } else if(pin == 3 || pin == 5 || pin == 6 || pin == 9 || pin == 10 || pin == 11) {
+    pin_pwm_on[pin] = true;
+    pin_pwm[pin] = value;
+    if(pin == PIN_DRV_EN) {
+      TCCR1A.value |= _BV(COM1B1);
+      OCR1B.value = value;
+    }
+  } else {
+    digitalWrite(pin, value < 128 ? LOW : HIGH);
+  }
+}
+
+static int pin_output(uint8_t pin) {
+  if(pin_mode[pin] != OUTPUT)
+    return 0;
+  if(pin == PIN_DRV_EN && (TCCR1A.value & _BV(COM1B1)))
+    return OCR1B.value;
+  if(pin_pwm_on[pin])
+    return pin_pwm[pin];
+  return pin_level(pin) ? 255 : 0;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*handler)(void), int mode) {
+  if(interrupt == 1) {
+    int1_handler = handler;
+    int1_mode = mode;
+  }
+}
+
+void detachInterrupt(uint8_t interrupt) {
+  if(interrupt == 1)
+    int1_handler = 0;
+}
+
+///////////////////////////////////////////////
+////////////////////TIME///////////////////////
+///////////////////////////////////////////////
+
+thread_local volatile unsigned long timer0_millis;
+
+unsigned long millis() {
+  now_us += HAL_CALL_US;
+  dispatch();
+  return (unsigned long)(now_us/1000) + timer0_millis;
+}
+
+unsigned long micros() {
+  now_us += HAL_CALL_US;
+  dispatch();
+  return (unsigned long)now_us;
+}
+
+uint8_t hal_tcnt0() {
+  return (uint8_t)(now_us*(F_CPU/1000000)/64);
+}
+
+void delay(unsigned long ms) {
+  now_us += ms*1000;
+  dispatch();
+}
+
+void delayMicroseconds(unsigned int us) {
+  now_us += us;
+  dispatch();
+}
+
+void hal_sleep() {
+  now_us += HAL_SLEEP_US;
+  dispatch();
+}
+
+void hal_cli() {
+  interrupts_enabled = false;
+}
+
+void hal_sei() {
+  interrupts_enabled = true;
+  dispatch();
+}
+
+///////////////////////////////////////////////
+//////////////////INTERRUPTS///////////////////
+///////////////////////////////////////////////
+
+// the next interrupt to run, in vector order, or 0
+static void (*pending_vector())(void) {
+  if(int1_pending && int1_handler)
+    return int1_handler;
+  if((TIMSK1.value & _BV(OCIE1A)) && hal_vector_timer1_compa)
+    return hal_vector_timer1_compa;
+  if((UCSR0B.value & _BV(UDRIE0)) && hal_vector_usart_udre)
+    return hal_vector_usart_udre;
+  if((ADCSRA.value & _BV(ADIF)) && (ADCSRA.value & _BV(ADIE)) && hal_vector_adc)
+    return hal_vector_adc;
+  if((TWCR.value & _BV(TWINT)) && (TWCR.value & _BV(TWIE)) && (TWCR.value & _BV(TWEN)) && hal_vector_twi)
+    return hal_vector_twi;
+  return 0;
+}
+
+static void dispatch() {
+  if(!interrupts_enabled || in_interrupt)
+    return;
+  in_interrupt = true;
+  for(int i=0; i<HAL_ISR_LIMIT; i++) {
+    void (*vector)(void) = pending_vector();
+    if(!vector)
+      break;
+    // flags the hardware clears on entering the interrupt
+    if(vector == int1_handler)
+      int1_pending = false;
+    else if(vector == hal_vector_adc)
+      ADCSRA.value &= ~_BV(ADIF);
+    else if(vector == hal_vector_timer1_compa)
+      TIFR1.value &= ~_BV(OCF1A);
+    vector();
+  }
+  in_interrupt = false;
+}
+
+///////////////////////////////////////////////
+//////////////////////ADC//////////////////////
+///////////////////////////////////////////////
+
+static int adc_input(uint8_t mux) {
+  switch(mux & 0x0F) {
+  case 0: return inputs.thermal;
+  case 3: return inputs.charge;
+  case 0x0E: return inputs.bandgap;
+  }
+  return 0;
+}
+
+static void adcsra_written(uint8_t value) {
+  // writing a 1 to ADIF clears it
+  if(value & _BV(ADIF))
+    value &= ~_BV(ADIF);
+  else
+    value |= ADCSRA.value & _BV(ADIF);
+  if(value & _BV(ADSC)) {
+    ADC.value = adc_input(ADMUX.value);
+    value = (value & ~_BV(ADSC)) | _BV(ADIF);
+  }
+  ADCSRA.value = value;
+}
+
+int analogRead(uint8_t pin) {
+  return adc_input(pin >= 14 ? pin-14 : pin);
+}
+
+///////////////////////////////////////////////
+////////////////ACCELEROMETER//////////////////
+///////////////////////////////////////////////
+
+// MMA7660 registers
+static thread_local uint8_t acc_regs[11];
+static thread_local uint8_t acc_reg;
+static thread_local bool acc_got_reg;
+
+// The chip samples on its own clock: at the SR register's rate, or at its
+//  auto-wake rate once auto-sleep (MODE's ASE) has counted SPCNT samples 
+//  without activity.  Its registers only change when it samples, so they can
+//  hold one sample over several updates.
+static const uint32_t acc_rate_us[] = {8333, 15625, 31250, 62500, 125000, 250000, 500000, 1000000};
+static const uint32_t acc_wake_rate_us[] = {31250, 62500, 125000, 1000000};
+static thread_local uint64_t acc_next_sample_us;
+static thread_local int acc_quiet; // samples without activity
+static thread_local bool acc_asleep;
+
+static void acc_load_inputs() {
+  for(int i=0; i<3; i++)
+    acc_regs[i] = inputs.acc[i] & 0x3F;
+  acc_regs[3] = inputs.acc_tilt;
+}
+
+static uint8_t acc_read() {
+  uint8_t value = acc_reg < sizeof(acc_regs) ? acc_regs[acc_reg] : 0;
+  if(acc_reg == 3) // reading TILT acknowledges the interrupt
+    set_pin_level(PIN_ACC_INT, HIGH);
+  acc_reg++;
+  return value;
+}
+
+static void acc_write(uint8_t data) {
+  if(!acc_got_reg) {
+    acc_reg = data;
+    acc_got_reg = true;
+    return;
+  }
+  if(acc_reg == 7 && (data & 0x01) != (acc_regs[7] & 0x01)) {
+    // in or out of standby: sampling starts afresh, awake
+    acc_next_sample_us = now_us;
+    acc_quiet = 0;
+    acc_asleep = false;
+  }
+  if(acc_reg < sizeof(acc_regs))
+    acc_regs[acc_reg] = data;
+  acc_reg++;
+}
+
+static uint32_t acc_period_us() {
+  if(acc_asleep)
+    return acc_wake_rate_us[(acc_regs[8]>>3) & 0x03];
+  return acc_rate_us[acc_regs[8] & 0x07];
+}
+
+// Activity is a change in TILT.  The interrupt line goes low on it (with 
+//  interrupts on), and stays low until TILT is read.
+static void acc_sample(const hal_inputs* in) {
+  for(int i=0; i<3; i++)
+    acc_regs[i] = in->acc[i] & 0x3F;
+  uint8_t tilt = in->acc_tilt;
+  if(acc_asleep || (acc_regs[8] & 0x07) != 0)
+    tilt &= ~0x20; // taps are only detected at 120 samples/second
+  bool activity = tilt != acc_regs[3];
+  acc_regs[3] = tilt;
+  if(activity && acc_regs[6] && pin_level(PIN_ACC_INT)) {
+    set_pin_level(PIN_ACC_INT, LOW);
+    if(int1_mode == FALLING || int1_mode == CHANGE)
+      int1_pending = true;
+  }
+  if(activity) {
+    acc_quiet = 0;
+    if(acc_regs[7] & 0x08) // AWE
+      acc_asleep = false;
+  } else if((acc_regs[7] & 0x10) && !acc_asleep && ++acc_quiet >= acc_regs[5]) { // ASE, SPCNT
+    acc_asleep = true;
+  }
+}
+
+// Takes the samples due by now.  A trace line's inputs are what the chip 
+//  sees from the last update to this one, so they're sampled with those.
+static void acc_update(const hal_inputs* next) {
+  if(!(acc_regs[7] & 0x01))
+    return; // standby
+  while(acc_next_sample_us <= now_us) {
+    acc_sample(next);
+    acc_next_sample_us += acc_period_us();
+  }
+}
+
+///////////////////////////////////////////////
+/////////////////////TWI///////////////////////
+///////////////////////////////////////////////
+
+static thread_local bool twi_started;
+static thread_local bool twi_acc_selected;
+
+static void twi_status(uint8_t status) {
+  TWSR.value = (TWSR.value & 0x07) | status;
+}
+
+static void twcr_written(uint8_t value) {
+  if(!(value & _BV(TWEN))) {
+    TWCR.value = value & ~_BV(TWINT);
+    twi_started = false;
+    return;
+  }
+  if(!(value & _BV(TWINT))) { // TWINT isn't cleared, so nothing happens yet
+    TWCR.value = (TWCR.value & _BV(TWINT)) | (value & ~_BV(TWINT));
+    return;
+  }
+
+  // clearing TWINT makes the hardware take its next step, which we finish at once
+  TWCR.value = value & ~(_BV(TWINT) | _BV(TWSTO));
+  if(value & _BV(TWSTO)) {
+    twi_started = false;
+    twi_acc_selected = false;
+    twi_status(0xF8);
+    return;
+  }
+  if(value & _BV(TWSTA)) {
+    twi_status(twi_started ? 0x10 : 0x08);
+    twi_started = true;
+  } else {
+    switch(TWSR.value & 0xF8) {
+    case 0x08: // START or repeated START sent, now the address
+    case 0x10: {
+      uint8_t address = TWDR.value;
+      twi_acc_selected = (address>>1) == ACC_ADDRESS;
+      if(address & 1) {
+        twi_status(twi_acc_selected ? 0x40 : 0x48);
+      } else {
+        acc_got_reg = false;
+        twi_status(twi_acc_selected ? 0x18 : 0x20);
+      }
+      break;
+    }
+    case 0x18: // writing
+    case 0x28:
+      acc_write(TWDR.value);
+      twi_status(0x28);
+      break;
+    case 0x40: // reading
+    case 0x50:
+      TWDR.value = acc_read();
+      twi_status((value & _BV(TWEA)) ? 0x50 : 0x58);
+      break;
+    default:
+      twi_status(0x00); // bus error
+    }
+  }
+  TWCR.value |= _BV(TWINT);
+}
+
+///////////////////////////////////////////////
+///////////////////EEPROM//////////////////////
+///////////////////////////////////////////////
+
+void eeprom_read_block(void* dst, const void* src, size_t n) {
+  size_t address = (size_t)src;
+  for(size_t i=0; i<n && address+i<=E2END; i++)
+    ((uint8_t*)dst)[i] = eeprom[address+i];
+}
+
+void eeprom_write_block(const void* src, void* dst, size_t n) {
+  size_t address = (size_t)dst;
+  for(size_t i=0; i<n && address+i<=E2END; i++)
+    eeprom[address+i] = ((const uint8_t*)src)[i];
+}
+
+uint8_t eeprom_read_byte(const uint8_t* address) {
+  uint8_t value = 0xFF;
+  eeprom_read_block(&value, address, 1);
+  return value;
+}
+
+void eeprom_write_byte(uint8_t* address, uint8_t value) {
+  eeprom_write_block(&value, address, 1);
+}
+
+///////////////////////////////////////////////
+////////////////////SERIAL/////////////////////
+///////////////////////////////////////////////
+
+size_t HardwareSerial::write(uint8_t c) {
+  if(c == '\n') {
+    if(serial_listener)
+      serial_listener(serial_line.c_str());
+    serial_line.clear();
+  } else if(c != '\r') {
+    serial_line += (char)c;
+  }
+  return 1;
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  for(size_t i=0; i<size; i++)
+    write(buffer[i]);
+  return size;
+}
+
+static std::string format_number(unsigned long n, int base) {
+  if(base < 2)
+    base = 10;
+  std::string digits;
+  do {
+    int digit = n % base;
+    digits.insert(digits.begin(), (char)(digit < 10 ? '0'+digit : 'A'+digit-10));
+    n /= base;
+  } while(n);
+  return digits;
+}
+
+size_t Print::print(long n, int base) {
+  if(base == DEC && n < 0)
+    return print('-') + print((unsigned long)-n, base);
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  return write(format_number(n, base).c_str());
+}
+
+// as Arduino's printFloat: rounded to digits places
+size_t Print::print(double number, int digits) {
+  if(isnan(number))
+    return print("nan");
+  if(isinf(number))
+    return print("inf");
+  if(number > 4294967040.0 || number < -4294967040.0)
+    return print("ovf"); // doesn't fit the unsigned long it's printed through
+  size_t n = 0;
+  if(number < 0.0) {
+    n += print('-');
+    number = -number;
+  }
+  double rounding = 0.5;
+  for(int i=0; i<digits; i++)
+    rounding /= 10.0;
+  number += rounding;
+  unsigned long whole = (unsigned long)number;
+  double remainder = number - (double)whole;
+  n += print(whole);
+  if(digits > 0)
+    n += print('.');
+  while(digits-- > 0) {
+    remainder *= 10.0;
+    int digit = int(remainder);
+    n += print((long)digit);
+    remainder -= digit;
+  }
+  return n;
+}
+
+// as avr-libc's itoa and friends: non-decimal bases show the 16 (or 32) bit pattern
+String::String(int value, unsigned char base)
+  : s(base == DEC ? (value < 0 ? "-" + format_number(-(long)value, base) : format_number(value, base))
+                  : format_number((uint16_t)value, base)) {}
+String::String(unsigned char value, unsigned char base) : s(format_number(value, base)) {}
+String::String(long value, unsigned char base)
+  : s(base == DEC ? (value < 0 ? "-" + format_number(-value, base) : format_number(value, base))
+                  : format_number((uint32_t)value, base)) {}
+
+///////////////////////////////////////////////
+/////////////////////DRIVER////////////////////
+///////////////////////////////////////////////
+
+void hal_reset(const hal_inputs* first) {
+  inputs = *first;
+  now_us = 0;
+  timer0_millis = 0;
+  interrupts_enabled = true; // the core's init() has run
+  in_interrupt = false;
+  for(int i=0; i<HAL_PINS; i++) {
+    pin_mode[i] = INPUT;
+    pin_pwm[i] = 0;
+    pin_pwm_on[i] = false;
+  }
+  PORTB.value = PORTC.value = PORTD.value = 0;
+  set_pin_level(PIN_ACC_INT, HIGH);
+  // phase correct 8 bit pwm on timer1, as the core sets it up
+  TCCR1A.value = 0x01;
+  TCCR1B.value = 0x03;
+  TIMSK1.value = TIFR1.value = 0;
+  OCR1A.value = OCR1B.value = 0;
+  ADMUX.value = 0;
+  ADCSRA.value = _BV(ADEN) | 0x06;
+  TWCR.value = TWSR.value = TWDR.value = TWBR.value = 0;
+  UCSR0A.value = UCSR0B.value = UCSR0C.value = 0;
+  int1_handler = 0;
+  int1_pending = false;
+  twi_started = twi_acc_selected = false;
+  memset(acc_regs, 0, sizeof(acc_regs));
+  acc_reg = 0;
+  acc_next_sample_us = 0;
+  acc_quiet = 0;
+  acc_asleep = false;
+  acc_load_inputs();
+  memset(eeprom, 0xFF, sizeof(eeprom));
+  serial_line.clear();
+}
+
+void hal_set_inputs(const hal_inputs* next) {
+  acc_update(next);
+  inputs = *next;
+  dispatch();
+}
+
+void hal_get_outputs(hal_outputs* outputs) {
+  outputs->drive = pin_output(PIN_DRV_EN);
+  outputs->drive_mode = pin_mode[PIN_DRV_MODE] == OUTPUT && pin_level(PIN_DRV_MODE);
+  outputs->gled = pin_output(PIN_GLED);
+  outputs->rled = pin_output(PIN_BUTTON);
+  outputs->power = pin_mode[PIN_PWR] == OUTPUT ? pin_level(PIN_PWR) : -1;
+}
+
+void hal_on_serial_line(void (*listener)(const char* line)) {
+  serial_listener = listener;
+}
+
+uint64_t hal_time_us() {
+  return now_us;
+}
@@ -0,0 +1,39 @@
+/*
+The replay driver's side of the host hal (tools/replay): set the inputs
+the light sees, and read back what it's doing.  All of it applies to the
+calling thread's light; each thread has its own.
+*/
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+
+// One update's worth of raw inputs, as the hardware presents them.
+struct hal_inputs {
+  int button;      // 1 while pressed
+  int thermal;     // adc readings (0-1023) of the thermal sensor,
+  int charge;      //  the charge pin,
+  int bandgap;     //  and the 1.1V bandgap against vcc
+  int acc[3];      // MMA7660 x, y, z, raw (-32 to 31, 21.3 = 1 G)
+  int acc_tilt;    // MMA7660 TILT register (both as it would sample them since the last update)
+};
+
+// What the light is doing.
+struct hal_outputs {
+  int drive;       // main led pwm (0-255), 0 while the driver is off
+  int drive_mode;  // DPIN_DRV_MODE: 1 is the driver's high mode
+  int gled;        // 0-255
+  int rled;        // 0-255
+  int power;       // DPIN_PWR: 1 holds the power on, 0 turns it off, -1 is an input (on while the button is held)
+};
+
+void hal_reset(const hal_inputs* inputs);
+void hal_set_inputs(const hal_inputs* inputs);
+void hal_get_outputs(hal_outputs* outputs);
+// called with each line the sketch or library prints (without the newline)
+void hal_on_serial_line(void (*listener)(const char* line));
+// microseconds since reset
+uint64_t hal_time_us();
+
+#endif
@@ -0,0 +1,100 @@
+/*
+Runs a sketch (and the unmodified hexbright library) on the host against
+a recorded trace of its inputs, one loop() per trace line, and prints
+what the light did.  Built and driven by replay.py:
+
+  replay trace.txt
+
+The trace format is described in trace.h.
+
+Output lists the light's state after setup(), then each update that
+changed it, then anything printed to Serial:
+
+  setup level=0 drive=0 mode=0 gled=0 rled=0 power=-1 charge=7 facing=0 orientation=0
+  12 level=1000 drive=255 mode=1 power=1
+  40 serial: some text
+
+Events show as the state they report changes of: charge is
+get_definite_charge_state (a change is a CHARGE_EVENT), facing and
+orientation (with the accelerometer) are get_facing and get_orientation
+(ACC_EVENT_ORIENTATION).  The event flags themselves aren't read:
+get_charge_events and get_accelerometer_events clear them, and they
+belong to the sketch.  So taps and shakes don't show here, except through
+what the sketch does with them; the trace's tilt column has them raw.
+*/
+
+#include <stdio.h>
+#include <vector>
+#include <Arduino.h>
+#include <hexbright.h>
+#include "hal.h"
+#include "trace.h"
+
+void setup();
+void loop();
+
+static std::string tick_label = "setup";
+
+static void print_serial(const char* text) {
+  printf("%s serial: %s\n", tick_label.c_str(), text);
+}
+
+static const char* names[] = {"level", "drive", "mode", "gled", "rled", "power", "charge",
+#ifdef ACCELEROMETER
+  "facing", "orientation",
+#endif
+};
+#define FIELDS (sizeof(names)/sizeof(names[0]))
+
+static void report(bool everything) {
+  static int last[FIELDS];
+  hal_outputs out;
+  hal_get_outputs(&out);
+  int now[FIELDS] = {hexbright::get_light_level(), out.drive, out.drive_mode, out.gled, out.rled, out.power,
+    hexbright::get_definite_charge_state(),
+#ifdef ACCELEROMETER
+    hexbright::get_facing(), hexbright::get_orientation(),
+#endif
+  };
+  std::string line;
+  for(size_t i=0; i<FIELDS; i++) {
+    if(everything || now[i] != last[i]) {
+      char field[32];
+      snprintf(field, sizeof(field), " %s=%d", names[i], now[i]);
+      line += field;
+    }
+    last[i] = now[i];
+  }
+  if(!line.empty())
+    printf("%s%s\n", tick_label.c_str(), line.c_str());
+}
+
+int main(int argc, char** argv) {
+  if(argc != 2) {
+    fprintf(stderr, "usage: %s trace.txt (or - for stdin)\n", argv[0]);
+    return 2;
+  }
+  std::vector<trace_line> trace;
+  if(!read_trace(argv[1], &trace))
+    return 2;
+
+  printf("# hexbright replay v1\n");
+  hal_on_serial_line(print_serial);
+  hal_reset(&trace[0].inputs);
+  setup();
+  report(true);
+
+  long tick = 0;
+  for(size_t i=0; i<trace.size(); i++) {
+    for(long n=0; n<trace[i].count; n++) {
+      char label[24];
+      snprintf(label, sizeof(label), "%ld", tick++);
+      tick_label = label;
+      hal_set_inputs(&trace[i].inputs);
+      loop();
+      report(false);
+    }
+  }
+  printf("# %ld updates, %.3f s\n", tick, hal_time_us()/1e6);
+  return 0;
+}
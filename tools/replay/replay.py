@@ -0,0 +1,191 @@
+#!/usr/bin/env python
+"""
+Replays recorded inputs through a sketch and the unmodified hexbright
+library on the host, much faster than real time, and checks what the
+light did against golden files.
+
+  python tools/replay/replay.py SKETCH TRACE [TRACE ...]
+  python tools/replay/replay.py SKETCH TRACE ... --golden DIR [--update]
+  python tools/replay/replay.py --from-telemetry run.csv > run.trace
+
+SKETCH is a .ino (or its directory under programs/).  The sketch, the
+library and a host stand-in for the arduino core and the avr's registers
+(tools/replay/hal) are built with the host's c++ compiler ($CXX, default
+g++); see trace.h for the trace format and replay.cpp for the output.
+
+Without --golden, the output is printed.  With --golden, each trace's
+output is compared with DIR/<sketch>-<trace>.out, and differences are
+shown (exit status 1 if any).  --update writes the golden files instead;
+review and commit them alongside the traces they came from.
+
+traces/ has a hand-written trace for each of the library's tuned
+behaviours, with its golden output in golden/.  Check a library change
+against them with
+
+  python tools/replay/replay.py wand tools/replay/traces/jab.trace --golden tools/replay/golden
+  python tools/replay/replay.py down_light tools/replay/traces/stationary.trace tools/replay/traces/asleep.trace --golden tools/replay/golden
+  python tools/replay/replay.py functional tools/replay/traces/overheat.trace --golden tools/replay/golden
+
+Traces can be written by hand (a count: prefix holds a line for several
+updates), or made from a TELEMETRY capture (tools/telemetry.py) with
+--from-telemetry.  Telemetry has the button and raw accelerometer
+exactly, but the thermal sensor is already filtered, and the charge and
+battery inputs aren't recorded (the trace has the on-battery defaults).
+
+The library's int is 16 bits on the avr and 32 here, so code that
+depends on 16 bit overflow can replay differently from the light.
+"""
+
+import csv
+import difflib
+import optparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, '..', 'bench'))
+import budget  # noqa: E402  (preprocess and feature sets are shared)
+
+HAL = os.path.join(HERE, 'hal')
+LIBRARY = os.path.join(budget.LIBRARIES, 'hexbright')
+CXXFLAGS = ['-O2', '-std=gnu++11', '-Wall', '-Wno-write-strings', '-DF_CPU=%dL' % budget.F_CPU, '-DARDUINO=100']
+# trace.cpp's DEFAULT_INPUTS, for the inputs telemetry doesn't record
+CHARGE_DEFAULT = 498
+BANDGAP_DEFAULT = 304
+
+
+def find_sketch(name):
+    if os.path.isdir(name):
+        name = os.path.join(name, os.path.basename(os.path.normpath(name)) + '.ino')
+    elif not os.path.exists(name):
+        candidate = os.path.join(budget.ROOT, 'programs', name, name + '.ino')
+        if os.path.exists(candidate):
+            name = candidate
+    if not os.path.exists(name):
+        sys.exit("can't find sketch %s" % name)
+    return name
+
+
+def build(sketch, flags, build_dir):
+    """Build the replay binary for sketch; returns its path."""
+    source = os.path.join(build_dir, 'sketch.cpp')
+    open(source, 'w').write(budget.preprocess(sketch))
+    binary = os.path.join(build_dir, 'replay')
+    compiler = os.environ.get('CXX', 'g++')
+    args = ([compiler] + CXXFLAGS + list(flags) +
+            ['-I' + HAL, '-I' + LIBRARY, '-I' + os.path.dirname(sketch),
+             source, os.path.join(LIBRARY, 'hexbright.cpp'),
+             os.path.join(HAL, 'hal.cpp'), os.path.join(HERE, 'trace.cpp'),
+             os.path.join(HERE, 'replay.cpp'),
+             '-o', binary])
+    proc = subprocess.Popen(args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    out = proc.communicate()[0].decode('utf-8', 'replace')
+    if proc.returncode:
+        sys.exit('building %s for replay failed:\n%s' % (sketch, out))
+    sys.stderr.write(out)  # warnings
+    return binary
+
+
+def run(binary, trace):
+    proc = subprocess.Popen([binary, trace], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    out, err = proc.communicate()
+    if proc.returncode:
+        sys.exit('replaying %s failed:\n%s' % (trace, err.decode('utf-8', 'replace')))
+    return out.decode('utf-8', 'replace')
+
+
+def golden_path(directory, sketch, trace):
+    name = os.path.splitext(os.path.basename(sketch))[0]
+    base = os.path.splitext(os.path.basename(trace))[0]
+    return os.path.join(directory, '%s-%s.out' % (name, base))
+
+
+def compare(output, golden):
+    if not os.path.exists(golden):
+        print('%s: missing (run with --update to create it)' % golden)
+        return False
+    expected = open(golden).read()
+    if expected == output:
+        print('%s: ok' % golden)
+        return True
+    print('%s: differs' % golden)
+    diff = list(difflib.unified_diff(expected.splitlines(), output.splitlines(),
+                                     'expected', 'replayed', lineterm=''))
+    for line in diff[:40]:
+        print('  ' + line)
+    if len(diff) > 40:
+        print('  ... %d more lines' % (len(diff) - 40))
+    return False
+
+
+def from_telemetry(path):
+    """A trace from tools/telemetry.py's csv."""
+    print('# hexbright trace v1, from %s' % os.path.basename(path))
+    print('# button thermal charge bandgap acc_x acc_y acc_z acc_tilt')
+    last = None
+    rows = csv.DictReader(open(path))
+    for row in rows:
+        update = int(row['update'])
+        if last is not None and update > last + 1:
+            # lost records: hold the last inputs through the gap
+            print('%d: %s' % (update - last - 1, line))
+        line = '%s %s %d %d %s %s %s 0' % (row['button'], row['temperature'],
+                                           CHARGE_DEFAULT, BANDGAP_DEFAULT,
+                                           row['accel_x'], row['accel_y'], row['accel_z'])
+        print(line)
+        last = update
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] SKETCH TRACE [TRACE ...]')
+    parser.add_option('--golden', metavar='DIR', help='compare with (or --update) golden files here')
+    parser.add_option('--update', action='store_true', help='write the golden files')
+    parser.add_option('--features', default='full',
+                      help='library feature set, as named by budget.py (default full)')
+    parser.add_option('--from-telemetry', metavar='CSV',
+                      help='print a trace made from a telemetry csv, and exit')
+    parser.add_option('--keep', metavar='DIR', help='build in DIR and keep it')
+    options, args = parser.parse_args()
+
+    if options.from_telemetry:
+        from_telemetry(options.from_telemetry)
+        return
+    if len(args) < 2:
+        parser.error('need a sketch and at least one trace')
+    if options.update and not options.golden:
+        parser.error('--update needs --golden')
+    flags = dict(budget.feature_sets()).get(options.features)
+    if flags is None:
+        sys.exit('unknown feature set %r; try one of: %s' %
+                 (options.features, ', '.join(n for n, f in budget.feature_sets())))
+
+    sketch = find_sketch(args[0])
+    build_dir = options.keep or tempfile.mkdtemp(prefix='hexbright-replay-')
+    if not os.path.isdir(build_dir):
+        os.makedirs(build_dir)
+    try:
+        binary = build(sketch, flags, build_dir)
+        ok = True
+        for trace in args[1:]:
+            output = run(binary, trace)
+            if not options.golden:
+                sys.stdout.write(output)
+            elif options.update:
+                golden = golden_path(options.golden, sketch, trace)
+                if not os.path.isdir(options.golden):
+                    os.makedirs(options.golden)
+                open(golden, 'w').write(output)
+                print('%s: written' % golden)
+            else:
+                ok = compare(output, golden_path(options.golden, sketch, trace)) and ok
+    finally:
+        if not options.keep:
+            shutil.rmtree(build_dir)
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,233 @@
+#!/usr/bin/env python
+"""
+Fits the head's thermal model (thermal_model.h) to logged runs, for
+simulating overheat protection with fleet.py's thermal experiment.
+
+  python tools/replay/thermal_fit.py run1.csv [run2.csv ...] -o head.model
+
+The logs are tools/telemetry.py csvs (captured with --ms, or give --ms
+here).  Each should start with the light at rest; include runs at
+different levels, with the light throttling and cooling, for a model
+that holds up.  The temperature column is converted to celsius with the
+library's default calibration (THERMAL_DEFAULT_*), or --calibration for
+a light with its own.
+
+The fit finds the ambient temperature, heat capacity, conductance to the
+air, sensor lag and (if the logs have at least three different levels)
+how power grows with level, by minimising the squared error between the
+model's sensor and the log.  Only ratios of power, capacity and
+conductance show in temperatures, so --power-w (the emitter's heat at
+level 1000) is taken as given.  The fit and its rms error are printed to
+stderr; the model is written as key=value lines.
+"""
+
+import csv
+import math
+import optparse
+import os
+import re
+import sys
+
+HEADER = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..',
+                      'libraries', 'hexbright', 'hexbright.h')
+PARAMETERS = ['ambient_c', 'power_w', 'power_exponent', 'capacity_j_per_c',
+              'conductance_w_per_c', 'sensor_tau_s']
+
+
+def default_calibration():
+    """(reading at 0C, reading at hot, hot celsius), as 10 bit readings."""
+    defines = {}
+    for line in open(HEADER):
+        m = re.match(r'#define\s+(THERMAL_\w+)\s+(.*?)\s*(//.*)?$', line)
+        if m:
+            defines[m.group(1)] = m.group(2)
+    extra = int(defines['THERMAL_EXTRA_BITS'])
+
+    def fine(name):
+        m = re.match(r'\(?(\d+)\s*<<\s*THERMAL_EXTRA_BITS\)?$', defines[name])
+        return int(m.group(1)) if m else int(defines[name]) / float(1 << extra)
+    return (fine('THERMAL_DEFAULT_ZERO'), fine('THERMAL_DEFAULT_HOT'),
+            int(defines['THERMAL_DEFAULT_HOT_CELSIUS']))
+
+
+class Run(object):
+    """A log, averaged into steps: per step, its length, the share of time
+    spent at each level, and the mean temperature."""
+
+    def __init__(self, path, ms, step, calibration):
+        zero, hot, hot_celsius = calibration
+        samples = []
+        for row in csv.DictReader(open(path)):
+            if row.get('seconds'):
+                t = float(row['seconds'])
+            elif ms:
+                t = int(row['update']) * ms / 1000.0
+            else:
+                sys.exit('%s has no seconds column; give --ms' % path)
+            celsius = (float(row['temperature']) - zero) * hot_celsius / (hot - zero)
+            level = min(int(row['level']), int(row['safe_level']))
+            samples.append((t, max(level, 0), celsius))
+        if len(samples) < 2:
+            sys.exit('%s has too few records' % path)
+        self.name = path
+        self.steps = []  # (seconds, {level: share}, celsius)
+        start = samples[0][0]
+        i = 0
+        while i < len(samples):
+            end = start + step
+            levels, temperatures = {}, []
+            while i < len(samples) and samples[i][0] < end:
+                levels[samples[i][1]] = levels.get(samples[i][1], 0) + 1
+                temperatures.append(samples[i][2])
+                i += 1
+            if temperatures:
+                total = float(len(temperatures))
+                shares = dict((l, n / total) for l, n in levels.items())
+                self.steps.append((step, shares, sum(temperatures) / total))
+            start = end
+        self.first_celsius = samples[0][2]
+        self.levels = set(s[1] for s in samples if s[1] > 0)
+
+
+def simulate(model, run):
+    """The model's sensor over each of run's steps, as thermal_model.cpp
+    works it out (with the level's power averaged over the step)."""
+    head = sensor = run.first_celsius
+    out = []
+    for seconds, shares, measured in run.steps:
+        power = sum(share * model['power_w'] * (level / 1000.0) ** model['power_exponent']
+                    for level, share in shares.items() if level > 0)
+        settled = model['ambient_c'] + power / model['conductance_w_per_c']
+        head_tau = model['capacity_j_per_c'] / model['conductance_w_per_c']
+        head = settled + (head - settled) * math.exp(-seconds / head_tau)
+        before = sensor
+        sensor = head + (sensor - head) * math.exp(-seconds / model['sensor_tau_s'])
+        out.append((before + sensor) / 2)  # the log is averaged over the step
+    return out
+
+
+def rms_error(model, runs):
+    error, n = 0.0, 0
+    for run in runs:
+        for predicted, step in zip(simulate(model, run), run.steps):
+            error += (predicted - step[2]) ** 2
+            n += 1
+    return math.sqrt(error / n)
+
+
+def nelder_mead(f, x0, scale, iterations=2000, tolerance=1e-6):
+    """Minimise f from x0 (a list), with a starting simplex scale wide."""
+    points = [list(x0)]
+    for i in range(len(x0)):
+        p = list(x0)
+        p[i] += scale[i]
+        points.append(p)
+    values = [f(p) for p in points]
+    for _ in range(iterations):
+        order = sorted(range(len(points)), key=lambda k: values[k])
+        points = [points[k] for k in order]
+        values = [values[k] for k in order]
+        if abs(values[-1] - values[0]) <= tolerance * (abs(values[0]) + tolerance):
+            break
+        centre = [sum(p[j] for p in points[:-1]) / (len(points) - 1) for j in range(len(x0))]
+
+        def towards(t):
+            return [c + t * (w - c) for c, w in zip(centre, points[-1])]
+        reflected = towards(-1)
+        r = f(reflected)
+        if r < values[0]:
+            expanded = towards(-2)
+            e = f(expanded)
+            points[-1], values[-1] = (expanded, e) if e < r else (reflected, r)
+        elif r < values[-2]:
+            points[-1], values[-1] = reflected, r
+        else:
+            contracted = towards(0.5)
+            c = f(contracted)
+            if c < values[-1]:
+                points[-1], values[-1] = contracted, c
+            else:  # shrink towards the best
+                for k in range(1, len(points)):
+                    points[k] = [b + 0.5 * (p - b) for b, p in zip(points[0], points[k])]
+                    values[k] = f(points[k])
+    best = min(range(len(points)), key=lambda k: values[k])
+    return points[best], values[best]
+
+
+def fit(runs, power_w, exponent):
+    fit_exponent = len(set().union(*[r.levels for r in runs])) >= 3
+    ambient = sum(r.first_celsius for r in runs) / len(runs)
+    # a first guess: heating to the hottest reading at the highest level
+    hottest = max(s[2] for r in runs for s in r.steps)
+    top = max([max(r.levels) for r in runs if r.levels] or [1000])
+    power = power_w * (top / 1000.0) ** exponent
+    conductance = power / max(hottest - ambient, 1.0)
+    duration = max(sum(s[0] for s in r.steps) for r in runs)
+    capacity = conductance * duration / 3
+
+    # positive parameters are fitted as logs
+    names = ['ambient_c', 'capacity_j_per_c', 'conductance_w_per_c', 'sensor_tau_s']
+    x0 = [ambient, math.log(capacity), math.log(conductance), math.log(10.0)]
+    scale = [2.0, 0.5, 0.5, 0.5]
+    if fit_exponent:
+        names.append('power_exponent')
+        x0.append(math.log(exponent))
+        scale.append(0.3)
+
+    def model_of(x):
+        model = {'power_w': power_w, 'power_exponent': exponent}
+        for name, value in zip(names, x):
+            model[name] = value if name == 'ambient_c' else math.exp(value)
+        return model
+    best, error = nelder_mead(lambda x: rms_error(model_of(x), runs), x0, scale)
+    # once more from where it settled, in case the simplex collapsed early
+    best, error = nelder_mead(lambda x: rms_error(model_of(x), runs), best, [s / 4 for s in scale])
+    return model_of(best), error, fit_exponent
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] LOG.csv [LOG.csv ...]')
+    parser.add_option('--output', '-o', metavar='FILE', help='write the model here (default stdout)')
+    parser.add_option('--ms', type='float', help="the sketch's update_delay_ms, if the logs have no seconds")
+    parser.add_option('--step', type='float', default=1.0,
+                      help='seconds of log averaged into each step of the fit (default 1)')
+    parser.add_option('--power-w', type='float', default=4.5,
+                      help="the emitter's heat at level 1000, in watts (default 4.5)")
+    parser.add_option('--exponent', type='float', default=1.8,
+                      help='power ~ level^exponent, if the logs can\'t tell (default 1.8)')
+    parser.add_option('--calibration', metavar='ZERO,HOT,CELSIUS',
+                      help='the light\'s thermal calibration, as 10 bit readings (default: the library\'s)')
+    options, args = parser.parse_args()
+    if not args:
+        parser.error('need at least one log')
+    if options.calibration:
+        try:
+            zero, hot, celsius = [float(v) for v in options.calibration.split(',')]
+        except ValueError:
+            parser.error('--calibration is ZERO,HOT,CELSIUS')
+        calibration = (zero, hot, celsius)
+    else:
+        calibration = default_calibration()
+
+    runs = [Run(path, options.ms, options.step, calibration) for path in args]
+    model, error, fitted_exponent = fit(runs, options.power_w, options.exponent)
+    for run in runs:
+        sys.stderr.write('%s: %d steps, rms error %.2fC\n' %
+                         (run.name, len(run.steps), rms_error(model, [run])))
+    if not fitted_exponent:
+        sys.stderr.write('fewer than 3 levels logged, power_exponent left at %g\n' % options.exponent)
+
+    lines = ['# hexbright thermal model (tools/replay/thermal_model.h)',
+             '# fitted by thermal_fit.py from %s' % ', '.join(os.path.basename(a) for a in args),
+             '# rms error %.2fC; power_w is given, not fitted' % error]
+    lines += ['%s=%.6g' % (name, model[name]) for name in PARAMETERS]
+    text = '\n'.join(lines) + '\n'
+    if options.output:
+        open(options.output, 'w').write(text)
+    else:
+        sys.stdout.write(text)
+    sys.stderr.write(''.join('  %s=%.4g\n' % (name, model[name]) for name in PARAMETERS))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,92 @@
+/*
+The head's thermal model, see thermal_model.h.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Arduino.h>
+#include <hexbright.h>
+#include "thermal_model.h"
+
+static const struct {
+  const char* name;
+  double thermal_model::*value;
+} parameters[] = {
+  {"ambient_c", &thermal_model::ambient_c},
+  {"power_w", &thermal_model::power_w},
+  {"power_exponent", &thermal_model::power_exponent},
+  {"capacity_j_per_c", &thermal_model::capacity_j_per_c},
+  {"conductance_w_per_c", &thermal_model::conductance_w_per_c},
+  {"sensor_tau_s", &thermal_model::sensor_tau_s},
+};
+#define PARAMETERS (sizeof(parameters)/sizeof(parameters[0]))
+
+bool set_thermal_model(thermal_model* model, const char* name, double value) {
+  for(size_t i=0; i<PARAMETERS; i++) {
+    if(!strcmp(parameters[i].name, name)) {
+      model->*parameters[i].value = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool read_thermal_model(const char* path, thermal_model* model) {
+  FILE* f = fopen(path, "r");
+  if(!f) {
+    fprintf(stderr, "can't read %s\n", path);
+    return false;
+  }
+  bool seen[PARAMETERS] = {false};
+  char line[256];
+  for(int number=1; fgets(line, sizeof(line), f); number++) {
+    char* p = line + strspn(line, " \t");
+    if(*p == '#' || *p == '\n' || *p == '\r' || !*p)
+      continue;
+    char* equals = strchr(p, '=');
+    char* end = NULL;
+    double value = equals ? strtod(equals+1, &end) : 0;
+    if(equals)
+      *equals = 0;
+    if(!equals || end == equals+1 || !set_thermal_model(model, p, value)) {
+      fprintf(stderr, "%s:%d: expected parameter=number\n", path, number);
+      fclose(f);
+      return false;
+    }
+    for(size_t i=0; i<PARAMETERS; i++)
+      if(!strcmp(parameters[i].name, p))
+        seen[i] = true;
+  }
+  fclose(f);
+  for(size_t i=0; i<PARAMETERS; i++) {
+    if(!seen[i]) {
+      fprintf(stderr, "%s: no %s\n", path, parameters[i].name);
+      return false;
+    }
+  }
+  return true;
+}
+
+void thermal_model_start(thermal_model* model) {
+  model->head_c = model->sensor_c = model->ambient_c;
+}
+
+void thermal_model_step(thermal_model* model, int level, double seconds) {
+  double power = level > 0 ? model->power_w * pow(level/1000.0, model->power_exponent) : 0;
+  // the head heads for where power and cooling balance, with time
+  //  constant capacity/conductance; the sensor follows it (for a step
+  //  this short, as if the head had been at its new value throughout)
+  double settled = model->ambient_c + power/model->conductance_w_per_c;
+  double head_tau = model->capacity_j_per_c/model->conductance_w_per_c;
+  model->head_c = settled + (model->head_c - settled)*exp(-seconds/head_tau);
+  model->sensor_c = model->head_c + (model->sensor_c - model->head_c)*exp(-seconds/model->sensor_tau_s);
+}
+
+int thermal_model_reading(const thermal_model* model) {
+  double fine = THERMAL_DEFAULT_ZERO +
+    model->sensor_c*(THERMAL_DEFAULT_HOT - THERMAL_DEFAULT_ZERO)/THERMAL_DEFAULT_HOT_CELSIUS;
+  int reading = (int)floor(fine/(1<<THERMAL_EXTRA_BITS) + 0.5);
+  return reading < 0 ? 0 : reading > 1023 ? 1023 : reading;
+}
@@ -0,0 +1,50 @@
+/*
+A lumped thermal model of the hexbright's head, for simulating overheat
+protection (fleet.cpp's thermal experiment).  Fitted from telemetry by
+thermal_fit.py, which has its own copy of these equations; keep the two
+the same.
+
+The head is one mass at head_c, heated by the emitter and cooled to the
+air, and the sensor follows it with a lag:
+
+  power = power_w * (level/1000)^power_exponent
+  capacity_j_per_c * dhead/dt = power - conductance_w_per_c*(head - ambient_c)
+  sensor_tau_s * dsensor/dt = head - sensor
+
+Each step holds the level constant, and is solved exactly rather than
+by small steps.  Only the ratios of power_w, capacity and conductance
+show in temperatures, so power_w is given (not fitted), and the other two
+are in proportion to it.
+
+The sensor's reading is worked out with the library's default thermal
+calibration (THERMAL_DEFAULT_*), as is get_celsius without a saved one.
+
+A model file is key=value lines, one per parameter above (# comments).
+*/
+
+#ifndef THERMAL_MODEL_H
+#define THERMAL_MODEL_H
+
+struct thermal_model {
+  double ambient_c;
+  double power_w;           // emitter heat at level 1000
+  double power_exponent;
+  double capacity_j_per_c;  // of the head
+  double conductance_w_per_c; // from the head to the air
+  double sensor_tau_s;
+
+  double head_c;
+  double sensor_c;
+};
+
+// false (after saying why on stderr) if the file is missing or incomplete
+bool read_thermal_model(const char* path, thermal_model* model);
+// sets a parameter by name; false if there's no such parameter
+bool set_thermal_model(thermal_model* model, const char* name, double value);
+// head and sensor at ambient
+void thermal_model_start(thermal_model* model);
+void thermal_model_step(thermal_model* model, int level, double seconds);
+// the sensor's raw 10 bit adc reading
+int thermal_model_reading(const thermal_model* model);
+
+#endif
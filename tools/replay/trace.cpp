@@ -0,0 +1,63 @@
+/*
+Reads input traces, see trace.h.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+const hal_inputs DEFAULT_INPUTS = {0, 208, 498, 304, {0, 0, 21}, 0};
+
+bool read_trace(FILE* f, std::vector<trace_line>* trace) {
+  hal_inputs inputs = DEFAULT_INPUTS;
+  char line[256];
+  for(int number=1; fgets(line, sizeof(line), f); number++) {
+    char* p = line;
+    while(*p == ' ' || *p == '\t')
+      p++;
+    if(*p == '#' || *p == '\n' || *p == '\r' || !*p)
+      continue;
+    trace_line t;
+    t.count = 1;
+    char* colon = strchr(p, ':');
+    if(colon) {
+      t.count = strtol(p, NULL, 10);
+      p = colon+1;
+    }
+    int* fields[] = {&inputs.button, &inputs.thermal, &inputs.charge, &inputs.bandgap,
+                     &inputs.acc[0], &inputs.acc[1], &inputs.acc[2], &inputs.acc_tilt};
+    for(unsigned i=0; i<sizeof(fields)/sizeof(fields[0]); i++) {
+      char* end;
+      long value = strtol(p, &end, 0);
+      if(end == p)
+        break;
+      *fields[i] = value;
+      p = end;
+    }
+    while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+      p++;
+    if(*p || t.count < 1) {
+      fprintf(stderr, "line %d: can't read '%s'\n", number, line);
+      return false;
+    }
+    t.inputs = inputs;
+    trace->push_back(t);
+  }
+  return true;
+}
+
+bool read_trace(const char* path, std::vector<trace_line>* trace) {
+  FILE* f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if(!f) {
+    fprintf(stderr, "can't read %s\n", path);
+    return false;
+  }
+  bool ok = read_trace(f, trace);
+  if(f != stdin)
+    fclose(f);
+  if(ok && trace->empty()) {
+    fprintf(stderr, "%s has no updates\n", path);
+    return false;
+  }
+  return ok;
+}
@@ -0,0 +1,32 @@
+/*
+Input traces for the host simulators (tools/replay), as text, one update
+per line:
+
+  # comment
+  [count:] button thermal charge bandgap acc_x acc_y acc_z acc_tilt
+
+The values are raw, as the hardware gives them (see hal.h).  A leading
+count repeats the line for that many updates; missing trailing values
+keep their last value (the first line's start from DEFAULT_INPUTS).
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <vector>
+#include "hal.h"
+
+// 25C (500mV + 10mV/C) on a 3.7V supply, charge pin floating (on battery), 1 G on z
+extern const hal_inputs DEFAULT_INPUTS;
+
+struct trace_line {
+  long count;
+  hal_inputs inputs;
+};
+
+// false (after saying why on stderr) if the trace can't be read
+bool read_trace(FILE* f, std::vector<trace_line>* trace);
+bool read_trace(const char* path, std::vector<trace_line>* trace);
+
+#endif
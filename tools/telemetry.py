@@ -0,0 +1,151 @@
+#!/usr/bin/env python
+"""
+Read the hexbright library's telemetry records (see TELEMETRY in
+libraries/hexbright/hexbright.h) from a serial port or a capture, and
+write them out as csv.
+
+  python tools/telemetry.py /dev/ttyUSB0 > run.csv
+  python tools/telemetry.py --baud 250000 /dev/ttyUSB0 -o run.csv
+  python tools/telemetry.py capture.bin -o run.csv
+
+Columns:
+
+  update,seconds,accel_x,accel_y,accel_z,temperature,level,safe_level,button,dropped
+
+update is unwrapped from the 16 bit count in each record; seconds needs
+--ms (the sketch's update_delay_ms) and is blank otherwise.  dropped is
+the number of records the light couldn't fit in its buffer just before
+this one.  Records with a bad checksum are skipped and counted; the
+totals are printed to stderr at the end (or on ctrl-c).
+"""
+
+import csv
+import optparse
+import os
+import re
+import struct
+import subprocess
+import sys
+
+SYNC = b'\xa5\x5a'
+# after the sync bytes: update, x, y, z, temperature, level, safe level,
+#  button, dropped, checksum
+RECORD = struct.Struct('<Hbbbhhh BBB')
+COLUMNS = ['update', 'seconds', 'accel_x', 'accel_y', 'accel_z', 'temperature',
+           'level', 'safe_level', 'button', 'dropped']
+
+
+def read_defines():
+    header = os.path.join(os.path.dirname(__file__), '..', 'libraries',
+                          'hexbright', 'hexbright.h')
+    values = {'TELEMETRY_BAUD': 38400, 'TELEMETRY_RECORD_BYTES': len(SYNC) + RECORD.size}
+    try:
+        for line in open(header):
+            m = re.match(r'#define\s+(TELEMETRY_\w+)\s+(\d+)', line)
+            if m:
+                values[m.group(1)] = int(m.group(2))
+    except IOError:
+        pass
+    if values['TELEMETRY_RECORD_BYTES'] != len(SYNC) + RECORD.size:
+        sys.exit('hexbright.h has %d byte records, this reads %d; update RECORD' %
+                 (values['TELEMETRY_RECORD_BYTES'], len(SYNC) + RECORD.size))
+    return values
+
+
+class Reader(object):
+    def __init__(self, writer, ms=None):
+        self.writer = writer
+        self.ms = ms
+        self.data = bytearray()
+        self.update = None
+        self.last = 0
+        self.records = self.dropped = self.bad = self.skipped = 0
+
+    def feed(self, data):
+        self.data.extend(bytearray(data))
+        size = len(SYNC) + RECORD.size
+        while True:
+            start = self.data.find(SYNC)
+            if start < 0:
+                # keep a trailing 0xA5, it may be half a sync
+                keep = 1 if self.data[-1:] == SYNC[:1] else 0
+                self.skipped += len(self.data) - keep
+                del self.data[:len(self.data) - keep]
+                return
+            if len(self.data) - start < size:
+                self.skipped += start
+                del self.data[:start]
+                return
+            body = bytes(self.data[start + len(SYNC):start + size])
+            fields = RECORD.unpack(body)
+            if sum(bytearray(body[:-1])) & 0xff != fields[-1]:
+                # not a record after all (or corrupted); resync past this sync
+                self.bad += 1
+                self.skipped += start + 1
+                del self.data[:start + 1]
+                continue
+            self.skipped += start
+            del self.data[:start + size]
+            self.record(fields[:-1])
+
+    def record(self, fields):
+        tick, x, y, z, temperature, level, safe, button, dropped = fields
+        if self.update is None:
+            self.update = tick
+        else:
+            self.update += (tick - self.last) & 0xffff
+        self.last = tick
+        self.records += 1
+        self.dropped += dropped
+        seconds = '%.3f' % (self.update * self.ms / 1000.0) if self.ms else ''
+        self.writer.writerow([self.update, seconds, x, y, z, temperature, level, safe,
+                              button, dropped])
+
+    def summary(self):
+        return ('%d records, %d dropped by the light, %d bad checksums, %d bytes skipped' %
+                (self.records, self.dropped, self.bad, self.skipped))
+
+
+def open_input(path, baud):
+    if path is None or path == '-':
+        return getattr(sys.stdin, 'buffer', sys.stdin)
+    if path.startswith('/dev/'):
+        subprocess.check_call(['stty', '-F', path, 'raw', '-echo', str(baud)])
+        return open(path, 'rb', 0)
+    return open(path, 'rb')
+
+
+def main():
+    defines = read_defines()
+    parser = optparse.OptionParser(usage='%prog [options] [serial port or capture file]')
+    parser.add_option('--baud', type='int', default=defines['TELEMETRY_BAUD'],
+                      help='serial port speed (default TELEMETRY_BAUD, %default)')
+    parser.add_option('--ms', type='float',
+                      help="sketch's update_delay_ms, to fill in the seconds column")
+    parser.add_option('-o', '--output', help='write the csv here instead of stdout')
+    options, args = parser.parse_args()
+    if len(args) > 1:
+        parser.error('one input at a time')
+
+    port = bool(args) and args[0].startswith('/dev/')
+    source = open_input(args[0] if args else None, options.baud)
+    out = open(options.output, 'w') if options.output else sys.stdout
+    writer = csv.writer(out, lineterminator='\n')
+    writer.writerow(COLUMNS)
+    reader = Reader(writer, options.ms)
+    try:
+        while True:
+            data = source.read(64 if port else 4096)
+            if not data:
+                break
+            reader.feed(data)
+            if port:
+                out.flush()
+    except KeyboardInterrupt:
+        pass
+    out.flush()
+    sys.stderr.write(reader.summary() + '\n')
+
+
+if __name__ == '__main__':
+    main()